@@ -0,0 +1,14 @@
+-- Built into cirnos.img, runs when the SD card has no main.lua
+
+ledPin = 47                    --> Initialize constant pin
+
+pinMode(ledPin, OUTPUT)        --> Set pin 47 (LED) to output mode
+
+print "No main.lua on the SD card, see ROOTDIR for an example."
+
+while true do                  --> Slow blink until the card is fixed
+   writePin(ledPin, ON)
+   delay(1000)
+   writePin(ledPin, OFF)
+   delay(1000)
+end
@@ -0,0 +1,558 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <malloc.h>
+#include "afs.h"
+#include "ff.h"
+#include "emmc.h"
+#include "diskcache.h"
+#include "sched.h"
+#include "luabuf.h"
+#include "mmu.h"
+#include "syscalls.h"
+#include "LUA/lauxlib.h"
+
+#define SECTOR_SIZE     512
+
+#define LUA_AFS_OP      "CirnOS.afsop"
+
+// What an operation returns
+#define AFS_READ        0       // A new buffer
+#define AFS_READ_INTO   1       // The byte count
+#define AFS_WRITE       2       // true
+
+// Consecutive sectors on the card and the memory they move to or from
+typedef struct afs_run {
+  uint32_t sector;
+  uint32_t count;
+  uint8_t *buf;
+} afs_run;
+
+// One afs call, held in the registry while its transfers run.
+// The environment table keeps [1] the buffer or data and [2] the path.
+typedef struct afs_op {
+  sd_request req;
+  sched_event done;
+  int ref;
+  int kind;
+  FRESULT error;        // Failure before or instead of the transfers
+  afs_run *runs;
+  uint32_t run_count;
+  uint32_t next_run;
+  uint32_t length;      // Bytes read or written
+  uint8_t *tail;        // Bounce for a partial last sector
+  uint8_t *tail_dst;    // Where a read tail is copied to
+  uint32_t tail_len;
+  uint8_t *copy;        // Sector padded copy of string data
+  FIL file;
+  int file_open;
+} afs_op;
+
+static void afs_add_run(afs_op *op, uint32_t sector, uint32_t count, uint8_t *buf)
+{
+  afs_run *run = &op->runs[op->run_count++];
+
+  run->sector = sector;
+  run->count = count;
+  run->buf = buf;
+}
+
+/**
+ * afs_map - Turns file sectors into runs of card sectors
+ *
+ * @op: Operation to add the runs to.
+ * @fp: File with a cluster map.
+ * @first: First sector within the file.
+ * @count: Number of sectors.
+ * @dst: Memory for the first sector, the rest follow.
+ *
+ * Adds one run per fragment touched. Returns the
+ * number of sectors mapped, short if the chain is.
+ */
+static uint32_t afs_map(afs_op *op, FIL *fp, uint32_t first, uint32_t count, uint8_t *dst)
+{
+  FATFS *fs = fp->obj.fs;
+  DWORD *tbl = fp->cltbl + 1;
+  uint32_t end = first + count;
+  uint32_t start = 0;
+  uint32_t mapped = 0;
+
+  while(tbl[0] && start < end) {
+    uint32_t sectors = tbl[0] * fs->csize;
+    uint32_t lo = first > start ? first : start;
+    uint32_t hi = end < start + sectors ? end : start + sectors;
+
+    if(lo < hi) {
+      afs_add_run(op, fs->database + (tbl[1] - 2) * fs->csize + (lo - start),
+                  hi - lo, dst + (lo - first) * SECTOR_SIZE);
+      mapped += hi - lo;
+    }
+    start += sectors;
+    tbl += 2;
+  }
+  return mapped;
+}
+
+// Frees everything but the userdata itself
+static void afs_release(afs_op *op)
+{
+  if(op->file_open) {
+    f_close(&op->file);
+    op->file_open = 0;
+  }
+  free(op->file.cltbl);
+  op->file.cltbl = NULL;
+  free(op->runs);
+  op->runs = NULL;
+  free(op->tail);
+  op->tail = NULL;
+  free(op->copy);
+  op->copy = NULL;
+}
+
+static const char *afs_message(FRESULT res)
+{
+  switch(res) {
+  case FR_NO_FILE:
+  case FR_NO_PATH:
+  case FR_INVALID_NAME:
+    return "File not found.";
+  case FR_DENIED:
+    return "Disk full.";
+  case FR_EXIST:
+  case FR_WRITE_PROTECTED:
+    return "Access denied.";
+  case FR_NOT_ENOUGH_CORE:
+    return "Out of memory.";
+  case FR_DISK_ERR:
+    return "Card error.";
+  default:
+    return "File system error.";
+  }
+}
+
+/**
+ * afs_results - Finishes an operation once its transfers are done
+ *
+ * @L: Lua state that waited.
+ * @ev: The operation's event.
+ *
+ * Runs outside of interrupts, so the file can be
+ * closed here. Pushes what the afs call returns.
+ */
+static int afs_results(lua_State *L, sched_event *ev)
+{
+  afs_op *op = (afs_op *)((uint8_t *)ev - offsetof(afs_op, done));
+  FRESULT res = op->error;
+
+  if(res == FR_OK && op->req.status != 0)
+    res = FR_DISK_ERR;
+  if(res == FR_OK && op->tail_dst)
+    memcpy(op->tail_dst, op->tail, op->tail_len);
+  if(op->file_open) {
+    FRESULT closed = f_close(&op->file);
+    op->file_open = 0;
+    if(res == FR_OK)
+      res = closed;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, op->ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, op->ref);
+  lua_getfenv(L, -1);
+  // Leave no half written file behind
+  if(res != FR_OK && op->kind == AFS_WRITE) {
+    lua_rawgeti(L, -1, 2);
+    f_unlink(lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  afs_release(op);
+
+  if(res != FR_OK) {
+    lua_pop(L, 2);
+    lua_pushnil(L);
+    lua_pushfstring(L, "AFS Error: %s", afs_message(res));
+    return 2;
+  }
+
+  switch(op->kind) {
+  case AFS_READ:
+    lua_rawgeti(L, -1, 1);
+    break;
+  case AFS_READ_INTO:
+    lua_pushnumber(L, op->length);
+    break;
+  default:
+    lua_pushboolean(L, 1);
+    break;
+  }
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return 1;
+}
+
+static void afs_set_run(afs_op *op)
+{
+  afs_run *run = &op->runs[op->next_run];
+
+  op->req.buf = run->buf;
+  op->req.sector = run->sector;
+  op->req.count = run->count;
+}
+
+// Called from the EMMC interrupt, queues the next run or wakes the caller
+static void afs_request_done(sd_request *req)
+{
+  afs_op *op = (afs_op *)req->arg;
+
+  if(req->status == 0 && ++op->next_run < op->run_count) {
+    afs_set_run(op);
+    if(sd_submit(req) == 0)
+      return;
+    req->status = -1;
+  }
+  sched_event_signal(&op->done);
+}
+
+/**
+ * afs_start - Runs an operation and waits for it
+ *
+ * @L: Lua environment
+ * @op: Operation with its runs, or with op->error set.
+ * @index: Stack index of the operation.
+ *
+ * Must be returned from the C function, see
+ * sched_event_wait.
+ */
+static int afs_start(lua_State *L, afs_op *op, int index)
+{
+  lua_pushvalue(L, index);
+  op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  op->done.results = afs_results;
+  sched_event_reset(&op->done);
+
+  op->req.is_write = op->kind == AFS_WRITE;
+  op->req.done = afs_request_done;
+  op->req.arg = op;
+  op->req.status = 0;
+  op->next_run = 0;
+
+  if(op->error != FR_OK || op->run_count == 0) {
+    sched_event_signal(&op->done);
+  } else {
+    afs_set_run(op);
+    if(sd_submit(&op->req) < 0) {
+      op->req.status = -1;
+      sched_event_signal(&op->done);
+    }
+  }
+  return sched_event_wait(L, &op->done);
+}
+
+/**
+ * afs_new - Pushes a new operation
+ *
+ * @L: Lua environment
+ * @kind: What the operation returns.
+ * @data: Stack index of the buffer or data to keep alive, or 0.
+ * @path: Stack index of the path.
+ */
+static afs_op *afs_new(lua_State *L, int kind, int data, int path)
+{
+  afs_op *op = (afs_op *)lua_newuserdata(L, sizeof(afs_op));
+
+  memset(op, 0, sizeof(afs_op));
+  op->kind = kind;
+  op->error = FR_OK;
+  luaL_getmetatable(L, LUA_AFS_OP);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 2, 0);
+  if(data) {
+    lua_pushvalue(L, data);
+    lua_rawseti(L, -2, 1);
+  }
+  lua_pushvalue(L, path);
+  lua_rawseti(L, -2, 2);
+  lua_setfenv(L, -2);
+  return op;
+}
+
+/**
+ * afs_read_file - Reads part of an open file
+ *
+ * @L: Lua environment
+ * @op: Operation holding the open file.
+ * @index: Stack index of the operation.
+ * @pos: Offset in the file.
+ * @dst: Cache line aligned memory to read to.
+ * @len: Bytes to read, within the file.
+ *
+ * Whole sectors go from the card straight to dst,
+ * a partial last one through a bounce sector.
+ * Files on other drives and unaligned offsets are
+ * read synchronously through FatFs.
+ */
+static int afs_read_file(lua_State *L, afs_op *op, int index,
+                         uint32_t pos, uint8_t *dst, uint32_t len)
+{
+  FIL *fp = &op->file;
+  uint32_t first = pos / SECTOR_SIZE;
+  uint32_t whole = len / SECTOR_SIZE;
+  uint32_t tail = len % SECTOR_SIZE;
+  uint32_t mapped;
+  uint32_t i;
+  UINT n;
+
+  op->length = len;
+  if(len == 0)
+    return afs_start(L, op, index);
+
+  if(fp->obj.fs->pdrv != 0 || pos % SECTOR_SIZE || file_linkmap(fp) != FR_OK) {
+    op->error = f_lseek(fp, pos);
+    if(op->error == FR_OK)
+      op->error = f_read(fp, dst, len, &n);
+    if(op->error == FR_OK && n != len)
+      op->error = FR_INT_ERR;
+    return afs_start(L, op, index);
+  }
+
+  // One run per fragment, plus the tail
+  op->runs = malloc(((fp->cltbl[0] - 2) / 2 + 1) * sizeof(afs_run));
+  if(tail)
+    op->tail = memalign(CACHE_LINE_SIZE, SECTOR_SIZE);
+  if(!op->runs || (tail && !op->tail)) {
+    op->error = FR_NOT_ENOUGH_CORE;
+    return afs_start(L, op, index);
+  }
+
+  mapped = afs_map(op, fp, first, whole, dst);
+  if(tail) {
+    op->tail_dst = dst + whole * SECTOR_SIZE;
+    op->tail_len = tail;
+    mapped += afs_map(op, fp, first + whole, 1, op->tail);
+  }
+  if(mapped != whole + (tail != 0)) {
+    op->error = FR_INT_ERR;
+    return afs_start(L, op, index);
+  }
+
+  for(i = 0; i < op->run_count; i++) {
+    if(diskcache_bypass(op->runs[i].sector, op->runs[i].count, 0) < 0) {
+      op->error = FR_DISK_ERR;
+      break;
+    }
+  }
+  return afs_start(L, op, index);
+}
+
+/**
+ * l_afs_read - Reads a whole file
+ *
+ * @L: Lua environment
+ *
+ * afs.read(path) returns a buffer with the file,
+ * or nil and a message.
+ */
+static int l_afs_read(lua_State *L)
+{
+  afs_op *op;
+  lua_buffer *buf;
+
+  luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  op = afs_new(L, AFS_READ, 0, 1);
+
+  op->error = f_open(&op->file, lua_tostring(L, 1), FA_READ);
+  if(op->error != FR_OK)
+    return afs_start(L, op, 2);
+  op->file_open = 1;
+
+  buf = luabuf_new(L, f_size(&op->file));
+  lua_getfenv(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, 1);
+  lua_pop(L, 1);
+  return afs_read_file(L, op, 2, 0, buf->data, buf->length);
+}
+
+/**
+ * l_afs_read_into - Reads part of a file into a buffer
+ *
+ * @L: Lua environment
+ *
+ * afs.readInto(path, buffer [, offset]) fills the
+ * buffer from offset in the file, or as much as is
+ * left, and returns the bytes read. Offsets that are
+ * multiples of 512 are the fast ones.
+ */
+static int l_afs_read_into(lua_State *L)
+{
+  lua_buffer *buf;
+  double offset;
+  uint32_t size;
+  uint32_t len;
+  afs_op *op;
+
+  luaL_checkstring(L, 1);
+  buf = luabuf_check(L, 2);
+  offset = luaL_optnumber(L, 3, 0);
+  if(offset < 0 || offset >= 4294967296.0 || (double)(uint32_t)offset != offset)
+    return luaL_error(L, "AFS Error: Invalid argument to afs.readInto (expected offset >= 0).");
+  lua_settop(L, 2);
+  op = afs_new(L, AFS_READ_INTO, 2, 1);
+
+  op->error = f_open(&op->file, lua_tostring(L, 1), FA_READ);
+  if(op->error != FR_OK)
+    return afs_start(L, op, 3);
+  op->file_open = 1;
+
+  size = f_size(&op->file);
+  len = 0;
+  if((uint32_t)offset < size) {
+    len = size - (uint32_t)offset;
+    if(len > buf->length)
+      len = buf->length;
+  }
+  return afs_read_file(L, op, 3, (uint32_t)offset, buf->data, len);
+}
+
+/**
+ * afs_write_runs - Plans the transfers of a write
+ *
+ * @op: Operation holding the file, expanded to len.
+ * @data: Bytes to write.
+ * @len: Number of bytes.
+ * @is_buffer: Nonzero if data is a cache line aligned buffer.
+ *
+ * Buffers go to the card directly. Strings are
+ * copied into sector aligned memory first.
+ */
+static FRESULT afs_write_runs(afs_op *op, const uint8_t *data, uint32_t len, int is_buffer)
+{
+  FATFS *fs = op->file.obj.fs;
+  uint32_t lba = fs->database + (op->file.obj.sclust - 2) * fs->csize;
+  uint32_t whole = len / SECTOR_SIZE;
+  uint32_t tail = len % SECTOR_SIZE;
+  uint32_t sectors = whole + (tail != 0);
+
+  op->runs = malloc(2 * sizeof(afs_run));
+  if(!op->runs)
+    return FR_NOT_ENOUGH_CORE;
+
+  if(!is_buffer) {
+    op->copy = memalign(CACHE_LINE_SIZE, sectors * SECTOR_SIZE);
+    if(!op->copy)
+      return FR_NOT_ENOUGH_CORE;
+    memcpy(op->copy, data, len);
+    memset(op->copy + len, 0, sectors * SECTOR_SIZE - len);
+    afs_add_run(op, lba, sectors, op->copy);
+  } else {
+    if(whole)
+      afs_add_run(op, lba, whole, (uint8_t *)data);
+    if(tail) {
+      op->tail = memalign(CACHE_LINE_SIZE, SECTOR_SIZE);
+      if(!op->tail)
+        return FR_NOT_ENOUGH_CORE;
+      memcpy(op->tail, data + whole * SECTOR_SIZE, tail);
+      memset(op->tail + tail, 0, SECTOR_SIZE - tail);
+      afs_add_run(op, lba + whole, 1, op->tail);
+    }
+  }
+
+  if(diskcache_bypass(lba, sectors, 1) < 0)
+    return FR_DISK_ERR;
+  return FR_OK;
+}
+
+/**
+ * l_afs_write - Writes a whole file
+ *
+ * @L: Lua environment
+ *
+ * afs.write(path, data) replaces the file with a
+ * string or buffer and returns true, or nil and a
+ * message. A buffer must not change until the call
+ * returns. The file is reserved in one piece so it
+ * can be written by sector, and written through
+ * FatFs when the free space is too scattered.
+ */
+static int l_afs_write(lua_State *L)
+{
+  lua_buffer *buf;
+  const uint8_t *data;
+  size_t len;
+  afs_op *op;
+  UINT n;
+
+  luaL_checkstring(L, 1);
+  buf = luabuf_test(L, 2);
+  if(buf) {
+    data = buf->data;
+    len = buf->length;
+  } else {
+    data = (const uint8_t *)luaL_checklstring(L, 2, &len);
+  }
+  lua_settop(L, 2);
+  op = afs_new(L, AFS_WRITE, 2, 1);
+  op->length = len;
+
+  op->error = f_open(&op->file, lua_tostring(L, 1), FA_WRITE | FA_CREATE_ALWAYS);
+  if(op->error != FR_OK)
+    return afs_start(L, op, 3);
+  op->file_open = 1;
+  if(len == 0)
+    return afs_start(L, op, 3);
+
+  if(op->file.obj.fs->pdrv == 0)
+    op->error = f_expand(&op->file, len, 1);
+  if(op->file.obj.fs->pdrv != 0 || op->error == FR_DENIED) {
+    op->error = f_write(&op->file, data, len, &n);
+    if(op->error == FR_OK && n != len)
+      op->error = FR_DENIED;
+  } else if(op->error == FR_OK) {
+    op->error = afs_write_runs(op, data, len, buf != 0);
+  }
+  return afs_start(L, op, 3);
+}
+
+// Frees what an operation interrupted by a Lua error still holds
+static int l_afs_op_gc(lua_State *L)
+{
+  afs_release((afs_op *)luaL_checkudata(L, 1, LUA_AFS_OP));
+  return 0;
+}
+
+static const luaL_Reg afs_functions[] = {
+  {"read", l_afs_read},
+  {"readInto", l_afs_read_into},
+  {"write", l_afs_write},
+  {NULL, NULL}
+};
+
+void afs_register(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_AFS_OP);
+  lua_pushcfunction(L, l_afs_op_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_register(L, 0, afs_functions);
+  lua_setglobal(L, "afs");
+}
@@ -0,0 +1,35 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "LUA/lua.h"
+
+#ifndef AFS_H
+#define AFS_H
+
+/**
+ * afs_register - Adds the asynchronous file library to Lua
+ *
+ * @L: Lua environment to add to
+ *
+ * Registers afs.read, afs.readInto and afs.write.
+ * File data on the SD card moves through the queue
+ * of sd_submit while the calling task yields, so
+ * other tasks keep running. The file system itself
+ * is still searched synchronously.
+ */
+void afs_register(lua_State *L);
+
+#endif
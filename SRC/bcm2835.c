@@ -9,6 +9,7 @@
 
 
 #include "bcm2835.h"
+#include "mmu.h"
 #include "macros.h"
 
 // This define enables a little test program (by default a blinking output on pin RPI_GPIO_PIN_11)
@@ -460,13 +461,10 @@ uint8_t bcm2835_spi_transfer(uint8_t value)
 	return ret;
 }
 
-// Writes (and reads) an number of bytes to SPI
-void bcm2835_spi_transfernb(char* tbuf, char* rbuf, uint32_t len)
+// Starts a transfer session: clears the FIFOs and asserts TA (and CS)
+void bcm2835_spi_begin_transfer(void)
 {
 	volatile uint32_t* paddr = bcm2835_spi0 + BCM2835_SPI0_CS/4;
-	volatile uint32_t* fifo = bcm2835_spi0 + BCM2835_SPI0_FIFO/4;
-	uint32_t TXCnt=0;
-	uint32_t RXCnt=0;
 
 	// This is Polled transfer as per section 10.6.1
 	// BUG ALERT: what happens if we get interupted in this section, and someone else
@@ -477,6 +475,17 @@ void bcm2835_spi_transfernb(char* tbuf, char* rbuf, uint32_t len)
 
 	// Set TA = 1
 	bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_TA, BCM2835_SPI0_CS_TA);
+}
+
+// Streams bytes through the FIFOs of an open session.
+// Received bytes go to rbuf, or are dropped if rbuf is 0.
+void bcm2835_spi_stream(const char* tbuf, char* rbuf, uint32_t len)
+{
+	volatile uint32_t* paddr = bcm2835_spi0 + BCM2835_SPI0_CS/4;
+	volatile uint32_t* fifo = bcm2835_spi0 + BCM2835_SPI0_FIFO/4;
+	uint32_t TXCnt=0;
+	uint32_t RXCnt=0;
+	uint32_t data;
 
 	// Use the FIFO's to reduce the interbyte times
 	while((TXCnt < len)||(RXCnt < len))
@@ -490,10 +499,19 @@ void bcm2835_spi_transfernb(char* tbuf, char* rbuf, uint32_t len)
 		//Rx fifo not empty, so get the next received bytes
 		while(((bcm2835_peri_read(paddr) & BCM2835_SPI0_CS_RXD))&&( RXCnt < len ))
 		{
-			rbuf[RXCnt] = bcm2835_peri_read_nb(fifo);
+			data = bcm2835_peri_read_nb(fifo);
+			if (rbuf)
+				rbuf[RXCnt] = data;
 			RXCnt++;
 		}
 	}
+}
+
+// Waits for the last byte to go out and releases TA (and CS)
+void bcm2835_spi_end_transfer(void)
+{
+	volatile uint32_t* paddr = bcm2835_spi0 + BCM2835_SPI0_CS/4;
+
 	// Wait for DONE to be set
 	while (!(bcm2835_peri_read_nb(paddr) & BCM2835_SPI0_CS_DONE))
 		;
@@ -502,45 +520,20 @@ void bcm2835_spi_transfernb(char* tbuf, char* rbuf, uint32_t len)
 	bcm2835_peri_set_bits(paddr, 0, BCM2835_SPI0_CS_TA);
 }
 
+// Writes (and reads) an number of bytes to SPI
+void bcm2835_spi_transfernb(char* tbuf, char* rbuf, uint32_t len)
+{
+	bcm2835_spi_begin_transfer();
+	bcm2835_spi_stream(tbuf, rbuf, len);
+	bcm2835_spi_end_transfer();
+}
+
 // Writes an number of bytes to SPI
 void bcm2835_spi_writenb(char* tbuf, uint32_t len)
 {
-	volatile uint32_t* paddr = bcm2835_spi0 + BCM2835_SPI0_CS/4;
-	volatile uint32_t* fifo = bcm2835_spi0 + BCM2835_SPI0_FIFO/4;
-
-	// This is Polled transfer as per section 10.6.1
-	// BUG ALERT: what happens if we get interupted in this section, and someone else
-	// accesses a different peripheral?
-
-	// Clear TX and RX fifos
-	bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_CLEAR, BCM2835_SPI0_CS_CLEAR);
-
-	// Set TA = 1
-	bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_TA, BCM2835_SPI0_CS_TA);
-
-	uint32_t i;
-	for (i = 0; i < len; i++)
-	{
-		// Maybe wait for TXD
-		while (!(bcm2835_peri_read(paddr) & BCM2835_SPI0_CS_TXD))
-			;
-
-		// Write to FIFO, no barrier
-		bcm2835_peri_write_nb(fifo, tbuf[i]);
-
-		// Read from FIFO to prevent stalling
-		while (bcm2835_peri_read(paddr) & BCM2835_SPI0_CS_RXD)
-			(void) bcm2835_peri_read_nb(fifo);
-	}
-
-	// Wait for DONE to be set
-	while (!(bcm2835_peri_read_nb(paddr) & BCM2835_SPI0_CS_DONE)) {
-		while (bcm2835_peri_read(paddr) & BCM2835_SPI0_CS_RXD)
-			(void) bcm2835_peri_read_nb(fifo);
-	};
-
-	// Set TA = 0, and also set the barrier
-	bcm2835_peri_set_bits(paddr, 0, BCM2835_SPI0_CS_TA);
+	bcm2835_spi_begin_transfer();
+	bcm2835_spi_stream(tbuf, 0, len);
+	bcm2835_spi_end_transfer();
 }
 
 // Writes (and reads) an number of bytes to SPI
@@ -730,6 +723,9 @@ void bcm2835_aux_muart_transfer_hexnl(uint32_t value)
 
 void bcm2835_mail_write(uint8_t channel, uint32_t value)
 {
+	// The GPU does not see the ARM data cache, so the
+	// message buffer has to be in RAM before it is sent
+	dcache_flush_all();
 	while(mmio_read(BCM2835_MAIL0_BASE + BCM2835_MAIL0_STATUS) & BCM2835_MAIL0_STATUS_MAIL_FULL);
 	mmio_write(BCM2835_MAIL0_BASE + BCM2835_MAIL0_WRITE, (value & 0xfffffff0) | (uint32_t)(channel & 0xf));
 }
@@ -743,7 +739,11 @@ uint32_t bcm2835_mail_read(uint8_t channel)
       uint32_t data = mmio_read(BCM2835_MAIL0_BASE + BCM2835_MAIL0_READ);
       uint8_t read_channel = (uint8_t)(data & 0xf);
       if(read_channel == channel)
-	return (data & 0xfffffff0);
+	{
+	  // Drop stale lines so the reply is read from RAM
+	  dcache_flush_all();
+	  return (data & 0xfffffff0);
+	}
     }
 }
 
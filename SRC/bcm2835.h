@@ -315,6 +315,7 @@
 #define BCM2835_H
 
 #include <stdint.h>
+#include "bcm2835_regs.h"
 
 #define MAP_FAILED	((void *) -1)
 
@@ -354,6 +355,14 @@
 #define BCM2835_AUX_BASE				(BCM2835_PERI_BASE + 0x215000)
 /// Base Physical Address of the mailbox and framebuffer registers
 #define BCM2835_MAIL0_BASE				(BCM2835_PERI_BASE + 0xB880)
+/// Base Physical Address of the interrupt controller registers
+#define BCM2835_IRQ_BASE				(BCM2835_PERI_BASE + 0xB200)
+/// Base Physical Address of the DMA controller, channel n is at + n * 0x100
+#define BCM2835_DMA_BASE				(BCM2835_PERI_BASE + 0x7000)
+/// Base Physical Address of DMA channel 15
+#define BCM2835_DMA15_BASE				(BCM2835_PERI_BASE + 0xE05000)
+/// Peripheral addresses as seen by the DMA controller
+#define BCM2835_PERI_BUS_BASE				0x7E000000
 
 /// Base of the ST (System Timer) registers.
 /// Available after bcm2835_init has been called
@@ -706,6 +715,10 @@ typedef enum
 #define BCM2835_ST_CS 							0x0000 ///< System Timer Control/Status
 #define BCM2835_ST_CLO 							0x0004 ///< System Timer Counter Lower 32 bits
 #define BCM2835_ST_CHI 							0x0008 ///< System Timer Counter Upper 32 bits
+#define BCM2835_ST_C1 							0x0010 ///< System Timer Compare 1
+#define BCM2835_ST_C3 							0x0018 ///< System Timer Compare 3
+#define BCM2835_ST_CS_M1 						0x0002 ///< Compare 1 matched, write 1 to clear
+#define BCM2835_ST_CS_M3 						0x0008 ///< Compare 3 matched, write 1 to clear
 
 /// @}
 
@@ -808,6 +821,101 @@ typedef enum
 	BCM2835_MAIL0_PROP	                = 8	
 } bcm2835Mail0Channels;
 
+// Defines for the interrupt controller
+// Offsets into the interrupt controller block in bytes per 7.5 Registers
+#define BCM2835_IRQ_BASIC_PENDING	0x0000 ///< IRQ basic pending
+#define BCM2835_IRQ_PENDING1		0x0004 ///< IRQ pending 1 (sources 0-31)
+#define BCM2835_IRQ_PENDING2		0x0008 ///< IRQ pending 2 (sources 32-63)
+#define BCM2835_IRQ_FIQ_CONTROL		0x000c ///< FIQ control
+#define BCM2835_IRQ_ENABLE1		0x0010 ///< Enable IRQs 1
+#define BCM2835_IRQ_ENABLE2		0x0014 ///< Enable IRQs 2
+#define BCM2835_IRQ_ENABLE_BASIC	0x0018 ///< Enable basic IRQs
+#define BCM2835_IRQ_DISABLE1		0x001c ///< Disable IRQs 1
+#define BCM2835_IRQ_DISABLE2		0x0020 ///< Disable IRQs 2
+#define BCM2835_IRQ_DISABLE_BASIC	0x0024 ///< Disable basic IRQs
+
+/// \brief bcm2835IRQSource
+/// Interrupt sources as numbered by the irq_* functions.
+/// 0-63 are the GPU peripheral interrupts, 64-71 the ARM basic interrupts.
+typedef enum
+{
+	BCM2835_IRQ_SYSTEM_TIMER_1	= 1,   ///< System timer compare 1
+	BCM2835_IRQ_SYSTEM_TIMER_3	= 3,   ///< System timer compare 3
+	BCM2835_IRQ_DMA0		= 16,  ///< DMA channel 0, channel n is 16 + n up to 10
+	BCM2835_IRQ_DMA_SHARED		= 27,  ///< DMA channels 11 to 14
+	BCM2835_IRQ_AUX			= 29,  ///< Mini UART and AUX SPI
+	BCM2835_IRQ_GPIO0		= 49,  ///< GPIO bank 0 events
+	BCM2835_IRQ_GPIO1		= 50,  ///< GPIO bank 1 events
+	BCM2835_IRQ_GPIO_ALL		= 52,  ///< Any GPIO event
+	BCM2835_IRQ_I2C			= 53,  ///< BSC1/BSC2
+	BCM2835_IRQ_SPI			= 54,  ///< SPI0
+	BCM2835_IRQ_UART		= 57,  ///< PL011 UART
+	BCM2835_IRQ_EMMC		= 62,  ///< EMMC/SD host
+	BCM2835_IRQ_ARM_TIMER		= 64,  ///< ARM timer
+	BCM2835_IRQ_ARM_MAILBOX		= 65,  ///< ARM mailbox
+	BCM2835_IRQ_COUNT		= 72,  ///< Number of sources
+} bcm2835IRQSource;
+
+// Defines for DMA
+// Offsets into a DMA channel block in bytes per 4.2.1 DMA Channel Register Address Map
+#define BCM2835_DMA_CS			0x0000 ///< Control and Status
+#define BCM2835_DMA_CONBLK_AD		0x0004 ///< Control Block Address
+#define BCM2835_DMA_TI			0x0008 ///< Transfer Information (from the control block)
+#define BCM2835_DMA_SOURCE_AD		0x000c ///< Source Address (from the control block)
+#define BCM2835_DMA_DEST_AD		0x0010 ///< Destination Address (from the control block)
+#define BCM2835_DMA_TXFR_LEN		0x0014 ///< Transfer Length (from the control block)
+#define BCM2835_DMA_STRIDE		0x0018 ///< 2D Stride (from the control block)
+#define BCM2835_DMA_NEXTCONBK		0x001c ///< Next Control Block Address
+#define BCM2835_DMA_DEBUG		0x0020 ///< Debug
+#define BCM2835_DMA_INT_STATUS		0x0fe0 ///< Interrupt status of each channel, from BCM2835_DMA_BASE
+#define BCM2835_DMA_ENABLE		0x0ff0 ///< Global enable bits for each channel, from BCM2835_DMA_BASE
+
+// Register masks for DMA_CS
+#define BCM2835_DMA_CS_ACTIVE		0x00000001 ///< Activate the DMA
+#define BCM2835_DMA_CS_END		0x00000002 ///< DMA end flag, write 1 to clear
+#define BCM2835_DMA_CS_INT		0x00000004 ///< Interrupt status, write 1 to clear
+#define BCM2835_DMA_CS_DREQ		0x00000008 ///< DREQ state
+#define BCM2835_DMA_CS_PAUSED		0x00000010 ///< DMA paused state
+#define BCM2835_DMA_CS_WAITING_WRITES	0x00000040 ///< Waiting for outstanding writes
+#define BCM2835_DMA_CS_ERROR		0x00000100 ///< DMA error
+#define BCM2835_DMA_CS_PRIORITY(x)	((x) << 16) ///< AXI priority level
+#define BCM2835_DMA_CS_PANIC_PRIORITY(x) ((x) << 20) ///< AXI panic priority level
+#define BCM2835_DMA_CS_WAIT_WRITES	0x10000000 ///< Wait for outstanding writes
+#define BCM2835_DMA_CS_DISDEBUG		0x20000000 ///< Disable debug pause signal
+#define BCM2835_DMA_CS_ABORT		0x40000000 ///< Abort the current control block
+#define BCM2835_DMA_CS_RESET		0x80000000 ///< DMA channel reset
+
+// Register masks for DMA_TI
+#define BCM2835_DMA_TI_INTEN		0x00000001 ///< Interrupt enable
+#define BCM2835_DMA_TI_TDMODE		0x00000002 ///< 2D mode
+#define BCM2835_DMA_TI_WAIT_RESP	0x00000008 ///< Wait for a write response
+#define BCM2835_DMA_TI_DEST_INC		0x00000010 ///< Destination address increment
+#define BCM2835_DMA_TI_DEST_WIDTH	0x00000020 ///< Destination transfer width 128 bits
+#define BCM2835_DMA_TI_DEST_DREQ	0x00000040 ///< Control destination writes with DREQ
+#define BCM2835_DMA_TI_DEST_IGNORE	0x00000080 ///< Ignore writes
+#define BCM2835_DMA_TI_SRC_INC		0x00000100 ///< Source address increment
+#define BCM2835_DMA_TI_SRC_WIDTH	0x00000200 ///< Source transfer width 128 bits
+#define BCM2835_DMA_TI_SRC_DREQ		0x00000400 ///< Control source reads with DREQ
+#define BCM2835_DMA_TI_SRC_IGNORE	0x00000800 ///< Ignore reads
+#define BCM2835_DMA_TI_BURST(x)		((x) << 12) ///< Burst transfer length
+#define BCM2835_DMA_TI_PERMAP(x)	((x) << 16) ///< Peripheral mapping (DREQ number)
+#define BCM2835_DMA_TI_WAITS(x)		((x) << 21) ///< Add wait cycles
+#define BCM2835_DMA_TI_NO_WIDE_BURSTS	0x04000000 ///< Don't do wide writes as a 2 beat burst
+
+// Register masks for DMA_DEBUG
+#define BCM2835_DMA_DEBUG_ERRORS	0x00000007 ///< Read last, FIFO and read errors, write 1 to clear
+
+/// \brief bcm2835DMADreq
+/// Peripheral DREQ signals for BCM2835_DMA_TI_PERMAP
+typedef enum
+{
+	BCM2835_DMA_DREQ_NONE		= 0,  ///< Always on
+	BCM2835_DMA_DREQ_PWM		= 5,  ///< PWM
+	BCM2835_DMA_DREQ_SPI_TX		= 6,  ///< SPI0 transmit
+	BCM2835_DMA_DREQ_SPI_RX		= 7,  ///< SPI0 receive
+	BCM2835_DMA_DREQ_EMMC		= 11, ///< EMMC
+} bcm2835DMADreq;
+
 // Historical name compatibility
 #ifndef BCM2835_NO_DELAY_COMPATIBILITY
 #define delay(x) bcm2835_delay(x)
@@ -1188,6 +1296,23 @@ extern "C" {
 	/// \param[in] len Number of bytes in the tbuf buffer, and the number of bytes to send
 	extern void bcm2835_spi_writenb(char* buf, uint32_t len);
 
+	/// Starts a transfer session on the currently selected SPI slave.
+	/// Clears the FIFOs and asserts TA, and so the CS pins, until bcm2835_spi_end_transfer.
+	/// Lets several buffers go out back to back without releasing CS.
+	/// \sa bcm2835_spi_stream()
+	extern void bcm2835_spi_begin_transfer(void);
+
+	/// Transfers bytes inside a session started by bcm2835_spi_begin_transfer.
+	/// Returns once every byte has been sent and its reply received.
+	/// \param[in] tbuf Buffer of bytes to send.
+	/// \param[out] rbuf Received bytes will by put in this buffer, or dropped if 0
+	/// \param[in] len Number of bytes to send/receive
+	extern void bcm2835_spi_stream(const char* tbuf, char* rbuf, uint32_t len);
+
+	/// Ends a session started by bcm2835_spi_begin_transfer.
+	/// Waits for the transfer to finish and deasserts TA.
+	extern void bcm2835_spi_end_transfer(void);
+
 	/// @}
 
 	/// Allows sending an arbitrary number of bytes to I2C slaves before issuing a repeated
@@ -0,0 +1,109 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+
+#ifndef BCM2835_REGS_H
+#define BCM2835_REGS_H
+
+// Register block layouts, written once and expanded both into C
+// structs and into the ffi.cdef string used by the Lua bcm2835
+// module. Each REG(type, name) is one field.
+
+/// GPIO registers at BCM2835_GPIO_BASE
+#define BCM2835_GPIO_REGS(REG) \
+  REG(uint32_t, gpfsel[6]) \
+  REG(uint32_t, reserved0) \
+  REG(uint32_t, gpset[2]) \
+  REG(uint32_t, reserved1) \
+  REG(uint32_t, gpclr[2]) \
+  REG(uint32_t, reserved2) \
+  REG(uint32_t, gplev[2]) \
+  REG(uint32_t, reserved3) \
+  REG(uint32_t, gpeds[2]) \
+  REG(uint32_t, reserved4) \
+  REG(uint32_t, gpren[2]) \
+  REG(uint32_t, reserved5) \
+  REG(uint32_t, gpfen[2]) \
+  REG(uint32_t, reserved6) \
+  REG(uint32_t, gphen[2]) \
+  REG(uint32_t, reserved7) \
+  REG(uint32_t, gplen[2]) \
+  REG(uint32_t, reserved8) \
+  REG(uint32_t, gparen[2]) \
+  REG(uint32_t, reserved9) \
+  REG(uint32_t, gpafen[2]) \
+  REG(uint32_t, reserved10) \
+  REG(uint32_t, gppud) \
+  REG(uint32_t, gppudclk[2])
+
+/// System timer registers at BCM2835_ST_BASE
+#define BCM2835_ST_REGS(REG) \
+  REG(uint32_t, cs) \
+  REG(uint32_t, clo) \
+  REG(uint32_t, chi) \
+  REG(uint32_t, c[4])
+
+/// SPI0 registers at BCM2835_SPI0_BASE
+#define BCM2835_SPI0_REGS(REG) \
+  REG(uint32_t, cs) \
+  REG(uint32_t, fifo) \
+  REG(uint32_t, clk) \
+  REG(uint32_t, dlen) \
+  REG(uint32_t, ltoh) \
+  REG(uint32_t, dc)
+
+/// PWM registers at BCM2835_GPIO_PWM
+#define BCM2835_PWM_REGS(REG) \
+  REG(uint32_t, ctl) \
+  REG(uint32_t, sta) \
+  REG(uint32_t, dmac) \
+  REG(uint32_t, reserved0) \
+  REG(uint32_t, rng1) \
+  REG(uint32_t, dat1) \
+  REG(uint32_t, fif1) \
+  REG(uint32_t, reserved1) \
+  REG(uint32_t, rng2) \
+  REG(uint32_t, dat2)
+
+/// Interrupt controller registers at BCM2835_IRQ_BASE
+#define BCM2835_IRQ_REGS(REG) \
+  REG(uint32_t, basic_pending) \
+  REG(uint32_t, pending[2]) \
+  REG(uint32_t, fiq_control) \
+  REG(uint32_t, enable[2]) \
+  REG(uint32_t, enable_basic) \
+  REG(uint32_t, disable[2]) \
+  REG(uint32_t, disable_basic)
+
+#define BCM2835_REG_FIELD(type, name) volatile type name;
+#define BCM2835_REG_CDEF(type, name) "volatile " #type " " #name ";"
+
+struct bcm2835_gpio_regs { BCM2835_GPIO_REGS(BCM2835_REG_FIELD) };
+struct bcm2835_st_regs { BCM2835_ST_REGS(BCM2835_REG_FIELD) };
+struct bcm2835_spi0_regs { BCM2835_SPI0_REGS(BCM2835_REG_FIELD) };
+struct bcm2835_pwm_regs { BCM2835_PWM_REGS(BCM2835_REG_FIELD) };
+struct bcm2835_irq_regs { BCM2835_IRQ_REGS(BCM2835_REG_FIELD) };
+
+/// The same structs as a string for ffi.cdef
+#define BCM2835_REGS_CDEF \
+  "struct bcm2835_gpio_regs {" BCM2835_GPIO_REGS(BCM2835_REG_CDEF) "};\n" \
+  "struct bcm2835_st_regs {" BCM2835_ST_REGS(BCM2835_REG_CDEF) "};\n" \
+  "struct bcm2835_spi0_regs {" BCM2835_SPI0_REGS(BCM2835_REG_CDEF) "};\n" \
+  "struct bcm2835_pwm_regs {" BCM2835_PWM_REGS(BCM2835_REG_CDEF) "};\n" \
+  "struct bcm2835_irq_regs {" BCM2835_IRQ_REGS(BCM2835_REG_CDEF) "};\n"
+
+#endif
@@ -0,0 +1,652 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <stddef.h>
+#include "diskcache.h"
+#include "emmc.h"
+#include "mmu.h"
+#include "timer.h"
+#include "sched.h"
+#include "luabuf.h"
+#include "LUA/lauxlib.h"
+
+#define CACHE_HASH_BITS         7
+#define CACHE_HASH_SIZE         (1 << CACHE_HASH_BITS)
+#define CACHE_HASH(sector)      (((sector) * 2654435761u) >> (32 - CACHE_HASH_BITS))
+
+// Holds a short run of misses plus its read-ahead, or a run of dirty sectors
+#define CACHE_STAGE_SECTORS     (DISKCACHE_BYPASS + DISKCACHE_READAHEAD)
+
+// Entry flags
+#define CACHE_DIRTY             0x1
+#define CACHE_META              0x2
+
+typedef struct cache_entry {
+  uint32_t sector;
+  uint32_t valid;
+  uint32_t flags;
+  uint8_t *data;
+  struct cache_entry *hash_next;
+  // Most recently used first
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+} cache_entry;
+
+static cache_entry entries[DISKCACHE_SECTORS];
+static cache_entry *buckets[CACHE_HASH_SIZE];
+static cache_entry *lru_head;
+static cache_entry *lru_tail;
+static uint8_t *cache_data;
+
+static uint8_t stage[CACHE_STAGE_SECTORS * DISKCACHE_SECTOR_SIZE]
+  __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The sector after the last read, to spot sequential access
+static uint32_t next_sector = 0xffffffff;
+static diskcache_stats stats;
+
+// Write-back state and policy
+static uint32_t dirty_count;
+static uint64_t dirty_since;
+static uint32_t flush_delay = DISKCACHE_FLUSH_DELAY * 1000;
+static uint32_t max_dirty = DISKCACHE_MAX_DIRTY;
+static cache_entry *flush_list[DISKCACHE_SECTORS];
+
+static void lru_unlink(cache_entry *e)
+{
+  if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else lru_head = e->lru_next;
+  if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else lru_tail = e->lru_prev;
+}
+
+static void lru_push_front(cache_entry *e)
+{
+  e->lru_prev = 0;
+  e->lru_next = lru_head;
+  if(lru_head) lru_head->lru_prev = e;
+  else lru_tail = e;
+  lru_head = e;
+}
+
+static void lru_push_back(cache_entry *e)
+{
+  e->lru_next = 0;
+  e->lru_prev = lru_tail;
+  if(lru_tail) lru_tail->lru_next = e;
+  else lru_head = e;
+  lru_tail = e;
+}
+
+static cache_entry *cache_lookup(uint32_t sector)
+{
+  cache_entry *e = buckets[CACHE_HASH(sector)];
+
+  while(e && e->sector != sector)
+    e = e->hash_next;
+  return e;
+}
+
+static void cache_unhash(cache_entry *e)
+{
+  cache_entry **link = &buckets[CACHE_HASH(e->sector)];
+
+  while(*link != e)
+    link = &(*link)->hash_next;
+  *link = e->hash_next;
+  e->valid = 0;
+}
+
+/**
+ * cache_insert - Stores a sector read from the card
+ *
+ * @sector: Sector number.
+ * @data: Its contents.
+ *
+ * Reuses the least recently used entry, which
+ * cache_make_room has made sure is clean.
+ */
+static void cache_insert(uint32_t sector, const uint8_t *data)
+{
+  cache_entry *e = lru_tail;
+
+  if(e->valid)
+    cache_unhash(e);
+  e->sector = sector;
+  e->valid = 1;
+  e->flags = 0;
+  memcpy(e->data, data, DISKCACHE_SECTOR_SIZE);
+
+  e->hash_next = buckets[CACHE_HASH(sector)];
+  buckets[CACHE_HASH(sector)] = e;
+  lru_unlink(e);
+  lru_push_front(e);
+}
+
+/**
+ * cache_drop - Forgets a cached sector
+ *
+ * @e: Entry to free, moved to the back of the LRU.
+ */
+static void cache_drop(cache_entry *e)
+{
+  cache_unhash(e);
+  lru_unlink(e);
+  lru_push_back(e);
+}
+
+static int compare_sector(const void *a, const void *b)
+{
+  uint32_t sa = (*(cache_entry * const *)a)->sector;
+  uint32_t sb = (*(cache_entry * const *)b)->sector;
+
+  return (sa > sb) - (sa < sb);
+}
+
+/**
+ * cache_flush_class - Writes back dirty sectors of one kind
+ *
+ * @meta: CACHE_META for FAT and directory sectors, 0 for data.
+ *
+ * Sorts the dirty sectors and writes each
+ * contiguous run with one multi-block command.
+ */
+static int cache_flush_class(uint32_t meta)
+{
+  uint32_t count = 0;
+  uint32_t i;
+  uint32_t j;
+
+  for(i = 0; i < DISKCACHE_SECTORS; i++) {
+    cache_entry *e = &entries[i];
+    if(e->valid && (e->flags & CACHE_DIRTY) && (e->flags & CACHE_META) == meta)
+      flush_list[count++] = e;
+  }
+  qsort(flush_list, count, sizeof(flush_list[0]), compare_sector);
+
+  for(i = 0; i < count; i = j) {
+    // Gather the run in stage
+    for(j = i; j < count && j - i < CACHE_STAGE_SECTORS &&
+          flush_list[j]->sector == flush_list[i]->sector + (j - i); j++)
+      memcpy(stage + (j - i) * DISKCACHE_SECTOR_SIZE, flush_list[j]->data, DISKCACHE_SECTOR_SIZE);
+
+    if(sd_write(stage, flush_list[i]->sector, j - i) < 0)
+      return -1;
+    stats.flushed += j - i;
+    stats.flush_runs++;
+    while(i < j) {
+      flush_list[i++]->flags &= ~CACHE_DIRTY;
+      dirty_count--;
+    }
+  }
+  return 0;
+}
+
+int diskcache_flush()
+{
+  // File data first: a crash in between leaves the FAT and
+  // directory entries describing the old, still intact file
+  if(cache_flush_class(0) < 0 || cache_flush_class(CACHE_META) < 0)
+    return -1;
+  return 0;
+}
+
+/**
+ * cache_make_room - Frees entries at the back of the LRU
+ *
+ * @count: Entries about to be reused.
+ *
+ * Flushes everything if one of them is dirty, so
+ * eviction never reorders data and metadata writes.
+ */
+static int cache_make_room(uint32_t count)
+{
+  cache_entry *e = lru_tail;
+
+  while(count-- && e) {
+    if(e->valid && (e->flags & CACHE_DIRTY))
+      return diskcache_flush();
+    e = e->lru_prev;
+  }
+  return 0;
+}
+
+/**
+ * diskcache_idle - Flushes overdue writes while the core waits
+ *
+ * @deadline: Time the caller has to be awake at.
+ *
+ * Only starts when the idle time can absorb
+ * a flush, later writes and syncs catch the rest.
+ */
+static void diskcache_idle(uint64_t deadline)
+{
+  uint64_t now;
+
+  if(dirty_count == 0)
+    return;
+  now = timer_now();
+  if(now - dirty_since >= flush_delay && now + DISKCACHE_FLUSH_BUDGET < deadline)
+    diskcache_flush();
+}
+
+int diskcache_init()
+{
+  uint32_t i;
+
+  if(!cache_data) {
+    cache_data = memalign(CACHE_LINE_SIZE, DISKCACHE_SECTORS * DISKCACHE_SECTOR_SIZE);
+    if(!cache_data)
+      return -1;
+    timer_add_idle_hook(diskcache_idle);
+  }
+
+  // Write back what the last mount left, a failure loses it
+  if(dirty_count)
+    diskcache_flush();
+  dirty_count = 0;
+  memset(buckets, 0, sizeof(buckets));
+  lru_head = lru_tail = 0;
+  for(i = 0; i < DISKCACHE_SECTORS; i++) {
+    entries[i].valid = 0;
+    entries[i].flags = 0;
+    entries[i].data = cache_data + i * DISKCACHE_SECTOR_SIZE;
+    lru_push_back(&entries[i]);
+  }
+  next_sector = 0xffffffff;
+  return 0;
+}
+
+/**
+ * cache_fill - Reads a run of missing sectors into the cache
+ *
+ * @sector: First missing sector.
+ * @count: Sectors the caller asked for.
+ * @ahead: Extra sectors to fetch after them.
+ *
+ * Leaves the requested sectors at the start of
+ * stage. Read-ahead stops at the first sector
+ * already cached and is dropped if it fails,
+ * e.g. at the end of the card.
+ */
+static int cache_fill(uint32_t sector, uint32_t count, uint32_t ahead)
+{
+  uint32_t extra = 0;
+  uint32_t i;
+
+  while(extra < ahead && !cache_lookup(sector + count + extra))
+    extra++;
+
+  // Before stage is filled, a flush goes through it
+  if(cache_make_room(count + extra) < 0)
+    return -1;
+
+  if(sd_read(stage, sector, count + extra) < 0) {
+    if(extra == 0 || sd_read(stage, sector, count) < 0)
+      return -1;
+    extra = 0;
+  }
+
+  // Read-ahead goes in first so the requested sectors end up more recent
+  for(i = count + extra; i > 0; i--)
+    cache_insert(sector + i - 1, stage + (i - 1) * DISKCACHE_SECTOR_SIZE);
+  stats.read_ahead += extra;
+  return 0;
+}
+
+int diskcache_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+  int sequential = (sector == next_sector);
+  uint32_t i = 0;
+
+  if(!cache_data)
+    return sd_read(buf, sector, count);
+  next_sector = sector + count;
+
+  while(i < count) {
+    cache_entry *e = cache_lookup(sector + i);
+    uint32_t run = 1;
+
+    if(e) {
+      memcpy(buf + i * DISKCACHE_SECTOR_SIZE, e->data, DISKCACHE_SECTOR_SIZE);
+      lru_unlink(e);
+      lru_push_front(e);
+      stats.hits++;
+      i++;
+      continue;
+    }
+
+    while(i + run < count && run < DISKCACHE_BYPASS && !cache_lookup(sector + i + run))
+      run++;
+    stats.misses += run;
+
+    if(run == DISKCACHE_BYPASS) {
+      // Keep going until the next cached sector, all of it uncached
+      while(i + run < count && !cache_lookup(sector + i + run)) {
+        run++;
+        stats.misses++;
+      }
+      if(sd_read(buf + i * DISKCACHE_SECTOR_SIZE, sector + i, run) < 0)
+        return -1;
+      stats.bypassed += run;
+    } else {
+      uint32_t ahead = (sequential && i + run == count) ? DISKCACHE_READAHEAD : 0;
+      if(cache_fill(sector + i, run, ahead) < 0)
+        return -1;
+      memcpy(buf + i * DISKCACHE_SECTOR_SIZE, stage, run * DISKCACHE_SECTOR_SIZE);
+    }
+    i += run;
+  }
+
+  return count;
+}
+
+int diskcache_write(const uint8_t *buf, uint32_t sector, uint32_t count, int meta)
+{
+  uint32_t i;
+  int ret;
+
+  if(!cache_data)
+    return sd_write((uint8_t *)buf, sector, count);
+  stats.written += count;
+
+  if(max_dirty == 0 || (!meta && count >= DISKCACHE_BYPASS)) {
+    // Long data runs already make good use of the card, write
+    // them now and keep cached copies in step
+    ret = sd_write((uint8_t *)buf, sector, count);
+    for(i = 0; i < count; i++) {
+      cache_entry *e = cache_lookup(sector + i);
+      if(!e)
+        continue;
+      if(ret >= 0) {
+        memcpy(e->data, buf + i * DISKCACHE_SECTOR_SIZE, DISKCACHE_SECTOR_SIZE);
+        if(e->flags & CACHE_DIRTY)
+          dirty_count--;
+        e->flags = 0;
+      } else if(!(e->flags & CACHE_DIRTY)) {
+        // A failed write leaves the card contents unknown
+        cache_drop(e);
+      }
+    }
+    return ret;
+  }
+
+  for(i = 0; i < count; i++) {
+    const uint8_t *data = buf + i * DISKCACHE_SECTOR_SIZE;
+    cache_entry *e = cache_lookup(sector + i);
+
+    if(e) {
+      memcpy(e->data, data, DISKCACHE_SECTOR_SIZE);
+      lru_unlink(e);
+      lru_push_front(e);
+    } else {
+      if(cache_make_room(1) < 0)
+        return -1;
+      cache_insert(sector + i, data);
+      e = lru_head;
+    }
+
+    if(!(e->flags & CACHE_DIRTY)) {
+      if(dirty_count == 0)
+        dirty_since = timer_now();
+      dirty_count++;
+    }
+    e->flags = CACHE_DIRTY | (meta ? CACHE_META : 0);
+  }
+
+  if(dirty_count >= max_dirty || timer_now() - dirty_since >= flush_delay) {
+    if(diskcache_flush() < 0)
+      return -1;
+  }
+  return count;
+}
+
+void diskcache_discard(uint32_t sector, uint32_t count)
+{
+  uint32_t i;
+
+  if(!cache_data)
+    return;
+  for(i = 0; i < count; i++) {
+    cache_entry *e = cache_lookup(sector + i);
+    if(!e)
+      continue;
+    if(e->flags & CACHE_DIRTY)
+      dirty_count--;
+    e->flags = 0;
+    cache_drop(e);
+  }
+}
+
+int diskcache_bypass(uint32_t sector, uint32_t count, int is_write)
+{
+  uint32_t i;
+
+  if(is_write) {
+    diskcache_discard(sector, count);
+    return 0;
+  }
+  if(!cache_data || dirty_count == 0)
+    return 0;
+  for(i = 0; i < count; i++) {
+    cache_entry *e = cache_lookup(sector + i);
+    if(e && (e->flags & CACHE_DIRTY))
+      return diskcache_flush();
+  }
+  return 0;
+}
+
+void diskcache_set_policy(uint32_t delay_ms, uint32_t dirty)
+{
+  flush_delay = delay_ms * 1000;
+  max_dirty = dirty;
+}
+
+void diskcache_get_stats(diskcache_stats *out)
+{
+  *out = stats;
+}
+
+/**
+ * l_disk_stats - Lua wrapper for diskcache_get_stats
+ *
+ * @L: Lua environment
+ *
+ * diskStats([reset]) returns a table of hits,
+ * misses, readAhead, bypassed, written, flushed,
+ * flushRuns, dirty, cached and size, counted in
+ * sectors. Passing true clears the counters
+ * afterwards.
+ */
+static int l_disk_stats(lua_State *L)
+{
+  uint32_t cached = 0;
+  uint32_t i;
+
+  for(i = 0; i < DISKCACHE_SECTORS; i++)
+    cached += entries[i].valid;
+
+  lua_createtable(L, 0, 10);
+  lua_pushnumber(L, stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, stats.read_ahead);
+  lua_setfield(L, -2, "readAhead");
+  lua_pushnumber(L, stats.bypassed);
+  lua_setfield(L, -2, "bypassed");
+  lua_pushnumber(L, stats.written);
+  lua_setfield(L, -2, "written");
+  lua_pushnumber(L, stats.flushed);
+  lua_setfield(L, -2, "flushed");
+  lua_pushnumber(L, stats.flush_runs);
+  lua_setfield(L, -2, "flushRuns");
+  lua_pushnumber(L, dirty_count);
+  lua_setfield(L, -2, "dirty");
+  lua_pushnumber(L, cached);
+  lua_setfield(L, -2, "cached");
+  lua_pushnumber(L, cache_data ? DISKCACHE_SECTORS : 0);
+  lua_setfield(L, -2, "size");
+
+  if(lua_toboolean(L, 1))
+    memset(&stats, 0, sizeof(stats));
+  return 1;
+}
+
+static int l_disk_sync(lua_State *L)
+{
+  if(diskcache_flush() < 0)
+    return luaL_error(L, "Disk Error: Could not write back cached sectors.");
+  return 0;
+}
+
+/**
+ * l_disk_flush_policy - Lua wrapper for diskcache_set_policy
+ *
+ * @L: Lua environment
+ *
+ * diskFlushPolicy(ms, maxDirty) writes cached
+ * sectors back at most ms after the first one
+ * got dirty, or once maxDirty are waiting.
+ * maxDirty 0 writes through.
+ */
+static int l_disk_flush_policy(lua_State *L)
+{
+  double ms = luaL_checknumber(L, 1);
+  double dirty = luaL_checknumber(L, 2);
+
+  if(ms < 0 || ms > 4000000 || (double)(uint32_t)ms != ms)
+    return luaL_error(L, "Disk Error: Invalid argument to diskFlushPolicy (expected ms >= 0).");
+  if(dirty < 0 || dirty > DISKCACHE_SECTORS || (double)(uint32_t)dirty != dirty)
+    return luaL_error(L, "Disk Error: Invalid argument to diskFlushPolicy (expected 0 <= maxDirty <= %d).",
+                      DISKCACHE_SECTORS);
+
+  diskcache_set_policy((uint32_t)ms, (uint32_t)dirty);
+  if(dirty_count && dirty_count >= max_dirty && diskcache_flush() < 0)
+    return luaL_error(L, "Disk Error: Could not write back cached sectors.");
+  return 0;
+}
+
+// A queued card transfer started from Lua
+typedef struct disk_request {
+  sd_request req;
+  sched_event done;
+  int ref;              // Keeps the request and its buffer alive
+} disk_request;
+
+static void disk_request_done(sd_request *req)
+{
+  sched_event_signal(&((disk_request *)req->arg)->done);
+}
+
+// What diskRead and diskWrite return once the transfer finished
+static int disk_request_results(lua_State *L, sched_event *ev)
+{
+  disk_request *dr = (disk_request *)((uint8_t *)ev - offsetof(disk_request, done));
+  int status = dr->req.status;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, dr->ref);
+  if(status == 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushnil(L);
+  lua_pushliteral(L, "Disk Error: Transfer failed.");
+  return 2;
+}
+
+/**
+ * disk_submit - Queues a transfer between a buffer and the card
+ *
+ * @L: Lua environment
+ * @is_write: Nonzero to write the buffer to the card.
+ *
+ * diskRead(sector, buffer) and diskWrite(sector, buffer)
+ * move the whole buffer, a multiple of 512 bytes. Tasks
+ * yield until the transfer is done, so other tasks run
+ * meanwhile. Return true, or nil and a message on a card
+ * error. The sector cache is kept coherent: dirty copies
+ * of sectors read are written back first and cached
+ * copies of sectors written are dropped.
+ */
+static int disk_submit(lua_State *L, int is_write)
+{
+  double sector = luaL_checknumber(L, 1);
+  lua_buffer *buf = luabuf_check(L, 2);
+  uint32_t count = buf->length / DISKCACHE_SECTOR_SIZE;
+  disk_request *dr;
+
+  if(sector < 0 || sector >= 4294967296.0 || (double)(uint32_t)sector != sector)
+    return luaL_error(L, "Disk Error: Invalid sector number.");
+  if(count == 0 || buf->length % DISKCACHE_SECTOR_SIZE)
+    return luaL_error(L, "Disk Error: Buffer length must be a multiple of %d.",
+                      DISKCACHE_SECTOR_SIZE);
+
+  if(diskcache_bypass((uint32_t)sector, count, is_write) < 0)
+    return luaL_error(L, "Disk Error: Could not write back cached sectors.");
+
+  dr = (disk_request *)lua_newuserdata(L, sizeof(disk_request));
+  memset(dr, 0, sizeof(disk_request));
+  // The buffer stays reachable through the request
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+
+  dr->req.buf = buf->data;
+  dr->req.sector = (uint32_t)sector;
+  dr->req.count = count;
+  dr->req.is_write = is_write;
+  dr->req.done = disk_request_done;
+  dr->req.arg = dr;
+  dr->done.results = disk_request_results;
+  sched_event_reset(&dr->done);
+
+  lua_pushvalue(L, -1);
+  dr->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if(sd_submit(&dr->req) < 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, dr->ref);
+    return luaL_error(L, "Disk Error: The card cannot take the transfer.");
+  }
+  return sched_event_wait(L, &dr->done);
+}
+
+static int l_disk_read(lua_State *L)
+{
+  return disk_submit(L, 0);
+}
+
+static int l_disk_write(lua_State *L)
+{
+  return disk_submit(L, 1);
+}
+
+void diskcache_register(lua_State *L)
+{
+  lua_pushcfunction(L, l_disk_stats);
+  lua_setglobal(L, "diskStats");
+  lua_pushcfunction(L, l_disk_sync);
+  lua_setglobal(L, "diskSync");
+  lua_pushcfunction(L, l_disk_flush_policy);
+  lua_setglobal(L, "diskFlushPolicy");
+  lua_pushcfunction(L, l_disk_read);
+  lua_setglobal(L, "diskRead");
+  lua_pushcfunction(L, l_disk_write);
+  lua_setglobal(L, "diskWrite");
+}
@@ -0,0 +1,159 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "LUA/lua.h"
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#define DISKCACHE_SECTOR_SIZE   512
+
+// Sectors kept in RAM, 128 KiB by default
+#ifndef DISKCACHE_SECTORS
+#define DISKCACHE_SECTORS       256
+#endif
+
+// Sectors fetched past a sequential read
+#ifndef DISKCACHE_READAHEAD
+#define DISKCACHE_READAHEAD     16
+#endif
+
+// Runs of missing sectors this long go straight to the
+// caller's buffer, so streaming a file does not flush the cache
+#ifndef DISKCACHE_BYPASS
+#define DISKCACHE_BYPASS        32
+#endif
+
+// Default flush policy: write back a second after the first
+// change, or once 64 sectors (32 KiB) are waiting
+#ifndef DISKCACHE_FLUSH_DELAY
+#define DISKCACHE_FLUSH_DELAY   1000
+#endif
+#ifndef DISKCACHE_MAX_DIRTY
+#define DISKCACHE_MAX_DIRTY     64
+#endif
+
+// Idle time in microseconds a timed flush needs to start
+#define DISKCACHE_FLUSH_BUDGET  20000
+
+typedef struct diskcache_stats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t read_ahead;
+  uint32_t bypassed;
+  uint32_t written;
+  uint32_t flushed;
+  uint32_t flush_runs;
+} diskcache_stats;
+
+/**
+ * diskcache_init - Sets up or empties the sector cache
+ *
+ * Allocates the cache on first use. Called
+ * whenever the card is initialised, dirty
+ * sectors are written back first.
+ * Returns 0 on success and -1 if out of memory.
+ */
+int diskcache_init();
+
+/**
+ * diskcache_read - Reads sectors through the cache
+ *
+ * @buf: Memory to read to.
+ * @sector: First sector.
+ * @count: Number of sectors.
+ *
+ * Returns count on success and -1 on a card error.
+ */
+int diskcache_read(uint8_t *buf, uint32_t sector, uint32_t count);
+
+/**
+ * diskcache_write - Writes sectors into the cache
+ *
+ * @buf: Memory to copy to the card.
+ * @sector: First sector.
+ * @count: Number of sectors.
+ * @meta: Nonzero for FAT and directory sectors.
+ *
+ * Keeps the sectors dirty until the flush policy
+ * or diskcache_flush writes them back. Long data
+ * runs go to the card at once. Returns count on
+ * success and -1 on a card error.
+ */
+int diskcache_write(const uint8_t *buf, uint32_t sector, uint32_t count, int meta);
+
+/**
+ * diskcache_flush - Writes back every dirty sector
+ *
+ * Data sectors go first, then metadata, each
+ * sorted and merged into multi-block writes.
+ * Returns 0 on success and -1 on a card error.
+ */
+int diskcache_flush();
+
+/**
+ * diskcache_discard - Forgets cached copies of sectors
+ *
+ * @sector: First sector.
+ * @count: Number of sectors.
+ *
+ * For callers writing the card directly with
+ * sd_write. Dirty copies are dropped unwritten.
+ */
+void diskcache_discard(uint32_t sector, uint32_t count);
+
+/**
+ * diskcache_bypass - Keeps the cache coherent around a direct transfer
+ *
+ * @sector: First sector.
+ * @count: Number of sectors.
+ * @is_write: Nonzero if the card is about to be written.
+ *
+ * Before a read, dirty copies of the sectors are
+ * written back. Before a write, cached copies are
+ * dropped. Returns 0 on success and -1 on a card error.
+ */
+int diskcache_bypass(uint32_t sector, uint32_t count, int is_write);
+
+/**
+ * diskcache_set_policy - Sets when dirty sectors are written back
+ *
+ * @delay_ms: Longest time a sector stays dirty.
+ * @dirty: Dirty sectors that force a flush, 0 to write through.
+ */
+void diskcache_set_policy(uint32_t delay_ms, uint32_t dirty);
+
+/**
+ * diskcache_get_stats - Reads the cache counters
+ *
+ * @stats: Filled in with the counters since boot
+ * or the last reset.
+ */
+void diskcache_get_stats(diskcache_stats *stats);
+
+/**
+ * diskcache_register - Adds the disk cache controls to Lua
+ *
+ * @L: Lua environment to add to
+ *
+ * Registers diskStats, diskSync, diskFlushPolicy,
+ * and diskRead and diskWrite for queued transfers
+ * that let other tasks run meanwhile.
+ */
+void diskcache_register(lua_State *L);
+
+#endif
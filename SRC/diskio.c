@@ -8,6 +8,8 @@
 #include "ff.h"
 #include "diskio.h"
 #include "emmc.h"
+#include "diskcache.h"
+#include "ramdisk.h"
 
 uint8_t disk_current_status = STA_NOINIT;
 
@@ -16,12 +18,16 @@ uint8_t disk_current_status = STA_NOINIT;
  *
  * @drv: The drive to init.
  *
- * Calls sd_card_init if drive is not 0.
+ * Calls sd_card_init for drive 0. The RAM
+ * disk is ready once ramdisk_create made it.
  */
 DSTATUS disk_initialize (uint8_t drv) {
-  if(drv) return RES_ERROR;    
+  if(drv == RAMDISK_DRIVE) return ramdisk_sectors() ? 0 : STA_NOINIT;
+  if(drv) return STA_NOINIT;
   if (sd_card_init() == 0) {
     disk_current_status &= ~STA_NOINIT;
+    // Runs without the cache if there is no room for it
+    diskcache_init();
   }
 
   return disk_current_status;
@@ -36,11 +42,13 @@ DSTATUS disk_initialize (uint8_t drv) {
  * @count: Amount of sectors to read.
  *
  * Starting from sector, reads count
- * sectors into buf.
+ * sectors into buf, through the sector cache.
  */
 DRESULT disk_read (uint8_t drv, uint8_t *buf, uint32_t sector, uint32_t count) {
-  if(drv) return RES_ERROR;  
-  if (sd_read(buf, sector, count) > 0)
+  if(drv == RAMDISK_DRIVE)
+    return ramdisk_read(buf, sector, count) > 0 ? RES_OK : RES_ERROR;
+  if(drv) return RES_ERROR;
+  if (diskcache_read(buf, sector, count) > 0)
     return RES_OK;
   else
     return RES_ERROR;
@@ -58,8 +66,11 @@ DRESULT disk_read (uint8_t drv, uint8_t *buf, uint32_t sector, uint32_t count) {
  * to card.
  */
 DRESULT disk_write (uint8_t drv, uint8_t *buf, uint32_t sector, uint32_t count) {
+  if(drv == RAMDISK_DRIVE)
+    return ramdisk_write(buf, sector, count) > 0 ? RES_OK : RES_ERROR;
   if(drv) return RES_ERROR;
-  if (sd_write(buf, sector, count) > 0)
+  // FatFs writes the FAT and directories from its window
+  if (diskcache_write(buf, sector, count, buf == SDFS.win) > 0)
     return RES_OK;
   else
     return RES_ERROR;
@@ -70,21 +81,37 @@ DRESULT disk_write (uint8_t drv, uint8_t *buf, uint32_t sector, uint32_t count)
  *
  * @drv: The drive to check
  *
- * Returns the current status of SD Card.
+ * Returns the current status of SD Card
+ * or the RAM disk.
  */
 DSTATUS disk_status (uint8_t drv) {
-  if(drv) return RES_ERROR;  
+  if(drv == RAMDISK_DRIVE) return ramdisk_sectors() ? 0 : STA_NOINIT;
+  if(drv) return STA_NOINIT;
   return disk_current_status;
 }
 
 /**
  * disk_ioctl - Only used by FatFs
  * 
- * Always returns true if the drive
- * can be accessed.
+ * CTRL_SYNC writes back the sector cache,
+ * anything else returns true if the drive
+ * can be accessed. The RAM disk also tells
+ * f_mkfs its size.
  */
 DRESULT disk_ioctl (uint8_t drv, uint8_t ctrl, void *buf) {
-  if(drv) return RES_ERROR;  
+  if(drv == RAMDISK_DRIVE) {
+    if(ctrl == GET_SECTOR_COUNT)
+      *(DWORD *)buf = ramdisk_sectors();
+    else if(ctrl == GET_BLOCK_SIZE)
+      *(DWORD *)buf = 1;
+    return RES_OK;
+  }
+  if(drv) return RES_ERROR;
+  // The card is never formatted from here
+  if (ctrl == GET_SECTOR_COUNT || ctrl == GET_BLOCK_SIZE)
+    return RES_PARERR;
+  if (ctrl == CTRL_SYNC && diskcache_flush() < 0)
+    return RES_ERROR;
   return RES_OK;
 }
 
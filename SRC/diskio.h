@@ -39,6 +39,11 @@ DRESULT disk_ioctl (uint8_t pdrv, uint8_t cmd, void* buff);
 #define STA_NODISK		0x02	/* No medium in the drive */
 #define STA_PROTECT		0x04	/* Write protected */
 
+/* FIL flag private to ff.c, for glue code that updates a FIL itself */
+/* (rawlog.c). ff.c defines it again after including this file, so a */
+/* FatFs update that changes the value breaks the build of ff.c. */
+#define FA_MODIFIED	0x40
+
 /* Command code for disk_ioctrl fucntion */
 
 /* Generic command (Used by FatFs) */
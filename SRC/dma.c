@@ -0,0 +1,327 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdint.h>
+#include "dma.h"
+#include "irq.h"
+#include "mmu.h"
+#include "bcm2835.h"
+
+// Assembly Macros
+#include "macros.h"
+
+#define DMA_REGS(channel) ((volatile uint32_t *)(BCM2835_DMA_BASE + (channel) * 0x100))
+#define DMA_REG(channel, offset) DMA_REGS(channel)[(offset) / 4]
+
+// Channels 11-14 share one interrupt line
+#define DMA_FIRST_SHARED        11
+#define DMA_FIRST_LITE          7
+
+// Returned by the firmware on a Pi Zero, used if the mailbox fails
+#define DMA_DEFAULT_MASK        0x7f35
+
+#define DMA_CS_START (BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_PRIORITY(8) | \
+                      BCM2835_DMA_CS_PANIC_PRIORITY(15) | BCM2835_DMA_CS_WAIT_WRITES)
+
+// Read/write bits of CS, kept when acknowledging an interrupt
+#define DMA_CS_CONTROL (BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_PRIORITY(0xf) | \
+                        BCM2835_DMA_CS_PANIC_PRIORITY(0xf) | BCM2835_DMA_CS_WAIT_WRITES | \
+                        BCM2835_DMA_CS_DISDEBUG)
+
+// Channels the firmware lets the ARM use, and those handed out
+static uint32_t dma_usable;
+static uint32_t dma_claimed;
+static int dma_shared_users;
+
+static struct {
+  dma_callback_t callback;
+  void *arg;
+} dma_callbacks[DMA_CHANNELS];
+
+static volatile uint32_t dma_mailbuffer[8] __attribute__((aligned(16)));
+
+void dma_init()
+{
+  dma_mailbuffer[0] = 7 * 4;		// size of this message
+  dma_mailbuffer[1] = 0;		// this is a request
+  dma_mailbuffer[2] = 0x00060001;	// get DMA channels tag
+  dma_mailbuffer[3] = 4;		// value buffer size
+  dma_mailbuffer[4] = 0;		// request length
+  dma_mailbuffer[5] = 0;		// space for the channel mask
+  dma_mailbuffer[6] = 0;		// closing tag
+
+  bcm2835_mail_write(BCM2835_MAIL0_PROP, dma_bus_address(dma_mailbuffer));
+  bcm2835_mail_read(BCM2835_MAIL0_PROP);
+
+  if(dma_mailbuffer[1] == BCM2835_MAIL0_SUCCESS)
+    dma_usable = dma_mailbuffer[5];
+  else
+    dma_usable = DMA_DEFAULT_MASK;
+
+  // Channel 15 lives elsewhere and is left to the firmware
+  dma_usable &= (1 << DMA_CHANNELS) - 1;
+}
+
+int dma_channel_alloc(int flags)
+{
+  uint32_t cpsr;
+  int channel = -1;
+  int i;
+
+  cpsr = irq_save();
+  if(!(flags & DMA_CHANNEL_FULL)) {
+    for(i = DMA_FIRST_LITE; i < DMA_CHANNELS && channel < 0; i++)
+      if((dma_usable & ~dma_claimed) & (1 << i))
+	channel = i;
+  }
+  for(i = 0; i < DMA_FIRST_LITE && channel < 0; i++)
+    if((dma_usable & ~dma_claimed) & (1 << i))
+      channel = i;
+  if(channel >= 0)
+    dma_claimed |= 1 << channel;
+  irq_restore(cpsr);
+
+  if(channel < 0)
+    return -1;
+
+  mmio_write(BCM2835_DMA_BASE + BCM2835_DMA_ENABLE,
+	     mmio_read(BCM2835_DMA_BASE + BCM2835_DMA_ENABLE) | (1 << channel));
+  DMA_REG(channel, BCM2835_DMA_CS) = BCM2835_DMA_CS_RESET;
+
+  return channel;
+}
+
+void dma_channel_free(int channel)
+{
+  uint32_t cpsr;
+
+  if(channel < 0 || channel >= DMA_CHANNELS)
+    return;
+
+  dma_abort(channel);
+  dma_set_callback(channel, 0, 0);
+
+  cpsr = irq_save();
+  dma_claimed &= ~(1 << channel);
+  irq_restore(cpsr);
+}
+
+dma_cb *dma_cb_alloc(uint32_t count)
+{
+  dma_cb *cb = memalign(sizeof(dma_cb), count * sizeof(dma_cb));
+
+  if(cb)
+    memset(cb, 0, count * sizeof(dma_cb));
+  return cb;
+}
+
+void dma_cb_free(dma_cb *cb)
+{
+  free(cb);
+}
+
+uint32_t dma_bus_address(const volatile void *address)
+{
+  uint32_t a = (uint32_t)address;
+
+  if(a >= BCM2835_PERI_BASE && a < BCM2835_PERI_BASE + 0x1000000)
+    return a - BCM2835_PERI_BASE + BCM2835_PERI_BUS_BASE;
+  if(a < BCM2835_PERI_BASE)
+    return a | DMA_BUS_RAM;
+  // Already a bus alias, like the framebuffer
+  return a;
+}
+
+void dma_cb_memcpy(dma_cb *cb, void *dest, const void *src, uint32_t len)
+{
+  // 32 bit bursts of 4 work on full and lite channels alike
+  cb->ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC | BCM2835_DMA_TI_BURST(4);
+  cb->source_ad = dma_bus_address(src);
+  cb->dest_ad = dma_bus_address(dest);
+  cb->txfr_len = len;
+  cb->stride = 0;
+  cb->nextconbk = 0;
+}
+
+void dma_cb_2d(dma_cb *cb, void *dest, int16_t dest_stride, const void *src,
+               int16_t src_stride, uint16_t width, uint16_t height)
+{
+  cb->ti = BCM2835_DMA_TI_TDMODE | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_INC |
+    BCM2835_DMA_TI_BURST(4);
+  cb->source_ad = dma_bus_address(src);
+  cb->dest_ad = dma_bus_address(dest);
+  // The controller runs YLENGTH + 1 rows
+  cb->txfr_len = ((uint32_t)(height - 1) << 16) | width;
+  cb->stride = ((uint32_t)(uint16_t)dest_stride << 16) | (uint16_t)src_stride;
+  cb->nextconbk = 0;
+}
+
+void dma_cb_link(dma_cb *cb, dma_cb *next)
+{
+  cb->nextconbk = next ? dma_bus_address(next) : 0;
+}
+
+void dma_start(int channel, dma_cb *cb)
+{
+  dma_cb *block = cb;
+
+  // Write the chain back so the controller sees it, stop if it loops
+  do {
+    dcache_clean(block, sizeof(dma_cb));
+    block = block->nextconbk ? (dma_cb *)(block->nextconbk & ~DMA_BUS_ALIAS_MASK) : 0;
+  } while(block && block != cb);
+
+  DMA_REG(channel, BCM2835_DMA_DEBUG) = BCM2835_DMA_DEBUG_ERRORS;
+  DMA_REG(channel, BCM2835_DMA_CS) = BCM2835_DMA_CS_END | BCM2835_DMA_CS_INT;
+  DMA_REG(channel, BCM2835_DMA_CONBLK_AD) = dma_bus_address(cb);
+  DMA_REG(channel, BCM2835_DMA_CS) = DMA_CS_START;
+}
+
+int dma_busy(int channel)
+{
+  return (DMA_REG(channel, BCM2835_DMA_CS) & BCM2835_DMA_CS_ACTIVE) != 0;
+}
+
+int dma_wait(int channel)
+{
+  uint32_t cs;
+
+  do {
+    cs = DMA_REG(channel, BCM2835_DMA_CS);
+    if(cs & BCM2835_DMA_CS_ERROR)
+      return -1;
+  } while(cs & BCM2835_DMA_CS_ACTIVE);
+
+  return 0;
+}
+
+void dma_abort(int channel)
+{
+  if(!dma_busy(channel))
+    return;
+
+  // Pause, let outstanding writes drain, then reset
+  DMA_REG(channel, BCM2835_DMA_CS) = 0;
+  while(DMA_REG(channel, BCM2835_DMA_CS) & BCM2835_DMA_CS_WAITING_WRITES) {}
+  DMA_REG(channel, BCM2835_DMA_CONBLK_AD) = 0;
+  DMA_REG(channel, BCM2835_DMA_CS) = BCM2835_DMA_CS_RESET;
+}
+
+/**
+ * dma_irq_channel - Acknowledges a channel interrupt
+ *
+ * @channel: Channel that may have raised it.
+ */
+static void dma_irq_channel(int channel)
+{
+  uint32_t cs = DMA_REG(channel, BCM2835_DMA_CS);
+
+  if(!(cs & BCM2835_DMA_CS_INT))
+    return;
+
+  // INT is write 1 to clear, but the control bits are plain read/write:
+  // a 0 in ACTIVE pauses a running chain and the priorities would reset
+  DMA_REG(channel, BCM2835_DMA_CS) = BCM2835_DMA_CS_INT | (cs & DMA_CS_CONTROL);
+  if(dma_callbacks[channel].callback)
+    dma_callbacks[channel].callback(channel, dma_callbacks[channel].arg);
+}
+
+static void dma_irq(void *arg)
+{
+  int channel = (int)arg;
+  uint32_t status;
+
+  if(channel < DMA_FIRST_SHARED) {
+    dma_irq_channel(channel);
+    return;
+  }
+
+  status = mmio_read(BCM2835_DMA_BASE + BCM2835_DMA_INT_STATUS);
+  for(channel = DMA_FIRST_SHARED; channel < DMA_CHANNELS; channel++)
+    if(status & (1 << channel))
+      dma_irq_channel(channel);
+}
+
+void dma_set_callback(int channel, dma_callback_t callback, void *arg)
+{
+  uint32_t cpsr;
+  int had;
+
+  if(channel < 0 || channel >= DMA_CHANNELS)
+    return;
+
+  cpsr = irq_save();
+  had = dma_callbacks[channel].callback != 0;
+  dma_callbacks[channel].callback = callback;
+  dma_callbacks[channel].arg = arg;
+
+  if(channel < DMA_FIRST_SHARED) {
+    if(callback && !had)
+      irq_register(BCM2835_IRQ_DMA0 + channel, dma_irq, (void *)channel);
+    else if(!callback && had)
+      irq_unregister(BCM2835_IRQ_DMA0 + channel);
+  } else {
+    if(callback && !had && dma_shared_users++ == 0)
+      irq_register(BCM2835_IRQ_DMA_SHARED, dma_irq, (void *)DMA_FIRST_SHARED);
+    else if(!callback && had && --dma_shared_users == 0)
+      irq_unregister(BCM2835_IRQ_DMA_SHARED);
+  }
+  irq_restore(cpsr);
+}
+
+int dma_memcpy(void *dest, const void *src, uint32_t len)
+{
+  uint32_t count = (len + DMA_LITE_MAX_LEN - 1) / DMA_LITE_MAX_LEN;
+  dma_cb *cb;
+  uint32_t i;
+  int channel;
+  int ret;
+
+  if(len == 0)
+    return 0;
+
+  channel = dma_channel_alloc(DMA_CHANNEL_ANY);
+  if(channel < 0)
+    return -1;
+  cb = dma_cb_alloc(count);
+  if(cb == 0) {
+    dma_channel_free(channel);
+    return -1;
+  }
+
+  dcache_clean(src, len);
+  dcache_invalidate(dest, len);
+
+  // Lite channels only take 16 bit lengths, so chain the copy
+  for(i = 0; i < count; i++) {
+    uint32_t offset = i * DMA_LITE_MAX_LEN;
+    uint32_t n = len - offset < DMA_LITE_MAX_LEN ? len - offset : DMA_LITE_MAX_LEN;
+    dma_cb_memcpy(&cb[i], (uint8_t *)dest + offset, (const uint8_t *)src + offset, n);
+    if(i > 0)
+      dma_cb_link(&cb[i - 1], &cb[i]);
+  }
+  dma_start(channel, cb);
+  ret = dma_wait(channel);
+
+  dcache_invalidate(dest, len);
+
+  dma_cb_free(cb);
+  dma_channel_free(channel);
+  return ret;
+}
@@ -0,0 +1,206 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef DMA_H
+#define DMA_H
+
+#define DMA_CHANNELS            15
+
+// Flags for dma_channel_alloc
+#define DMA_CHANNEL_ANY         0x0
+// Channels 0-6 support 2D mode and wide bursts, 7-14 are lite channels
+#define DMA_CHANNEL_FULL        0x1
+
+// Longest linear block a lite channel runs, its TXFR_LEN has 16 bits
+#define DMA_LITE_MAX_LEN        0xffe0
+
+// RAM as seen from the DMA controller, through the L2 coherent alias
+#define DMA_BUS_RAM             0x40000000
+#define DMA_BUS_ALIAS_MASK      0xC0000000
+
+// A control block as read by the DMA controller, must be 32 byte aligned
+typedef struct dma_cb {
+  uint32_t ti;
+  uint32_t source_ad;
+  uint32_t dest_ad;
+  uint32_t txfr_len;
+  uint32_t stride;
+  uint32_t nextconbk;
+  uint32_t reserved[2];
+} __attribute__((aligned(32))) dma_cb;
+
+typedef void (*dma_callback_t)(int channel, void *arg);
+
+/**
+ * dma_init - Finds the DMA channels usable by the ARM
+ *
+ * Asks the firmware which channels it left free.
+ * Must run after bcm2835_init.
+ */
+void dma_init();
+
+/**
+ * dma_channel_alloc - Claims a DMA channel
+ *
+ * @flags: DMA_CHANNEL_FULL to require a channel with 2D mode.
+ *
+ * Lite channels are handed out first when
+ * flags allow it. Returns the channel number
+ * or -1 if none is free.
+ */
+int dma_channel_alloc(int flags);
+
+/**
+ * dma_channel_free - Releases a DMA channel
+ *
+ * @channel: Channel from dma_channel_alloc.
+ *
+ * Aborts any transfer and removes the callback.
+ */
+void dma_channel_free(int channel);
+
+/**
+ * dma_cb_alloc - Allocates control blocks
+ *
+ * @count: Number of consecutive control blocks.
+ *
+ * Returns zeroed, aligned blocks or 0.
+ */
+dma_cb *dma_cb_alloc(uint32_t count);
+
+/**
+ * dma_cb_free - Frees control blocks
+ *
+ * @cb: Blocks from dma_cb_alloc.
+ */
+void dma_cb_free(dma_cb *cb);
+
+/**
+ * dma_cb_memcpy - Fills in a linear copy
+ *
+ * @cb: Control block to fill in.
+ * @dest: Destination, an ARM address.
+ * @src: Source, an ARM address.
+ * @len: Bytes to copy, at most DMA_LITE_MAX_LEN
+ *       unless the channel is a full one.
+ *
+ * Clears the link to the next block.
+ */
+void dma_cb_memcpy(dma_cb *cb, void *dest, const void *src, uint32_t len);
+
+/**
+ * dma_cb_2d - Fills in a rectangular copy
+ *
+ * @cb: Control block to fill in.
+ * @dest: Destination of the first row, an ARM address.
+ * @dest_stride: Bytes from the end of one destination row to the next.
+ * @src: Source of the first row, an ARM address.
+ * @src_stride: Bytes from the end of one source row to the next.
+ * @width: Bytes per row, up to 65535.
+ * @height: Number of rows, 1 to 16384.
+ *
+ * Only full channels run 2D blocks. Strides are
+ * signed 16 bit values.
+ */
+void dma_cb_2d(dma_cb *cb, void *dest, int16_t dest_stride, const void *src,
+               int16_t src_stride, uint16_t width, uint16_t height);
+
+/**
+ * dma_cb_link - Chains two control blocks
+ *
+ * @cb: Block to run first.
+ * @next: Block to run afterwards, or 0 to end the chain.
+ */
+void dma_cb_link(dma_cb *cb, dma_cb *next);
+
+/**
+ * dma_bus_address - Translates an ARM address for the DMA
+ *
+ * @address: ARM physical address.
+ *
+ * Returns the matching bus address for RAM
+ * or peripherals.
+ */
+uint32_t dma_bus_address(const volatile void *address);
+
+/**
+ * dma_start - Starts a control block chain
+ *
+ * @channel: Channel from dma_channel_alloc.
+ * @cb: First block of the chain.
+ *
+ * Writes the blocks back from the data cache
+ * first. Data buffers are the caller's job:
+ * dcache_clean sources and dcache_invalidate
+ * destinations before starting, and invalidate
+ * destinations again once the transfer is done.
+ */
+void dma_start(int channel, dma_cb *cb);
+
+/**
+ * dma_busy - Checks if a channel is still running
+ *
+ * @channel: Channel from dma_channel_alloc.
+ */
+int dma_busy(int channel);
+
+/**
+ * dma_wait - Waits for a channel to finish
+ *
+ * @channel: Channel from dma_channel_alloc.
+ *
+ * Returns 0 on success and -1 if the
+ * controller reported an error.
+ */
+int dma_wait(int channel);
+
+/**
+ * dma_abort - Stops a channel
+ *
+ * @channel: Channel from dma_channel_alloc.
+ */
+void dma_abort(int channel);
+
+/**
+ * dma_set_callback - Calls back when a block raises an interrupt
+ *
+ * @channel: Channel from dma_channel_alloc.
+ * @callback: Run in IRQ mode, or 0 to remove.
+ * @arg: Passed to callback.
+ *
+ * Only blocks with BCM2835_DMA_TI_INTEN set
+ * raise the interrupt.
+ */
+void dma_set_callback(int channel, dma_callback_t callback, void *arg);
+
+/**
+ * dma_memcpy - Copies memory with the DMA and waits
+ *
+ * @dest: Destination.
+ * @src: Source.
+ * @len: Bytes to copy.
+ *
+ * Handles cache maintenance and splits long
+ * copies into a chain of DMA_LITE_MAX_LEN blocks.
+ * Returns 0 on success and -1 if no channel was
+ * free or the transfer failed.
+ */
+int dma_memcpy(void *dest, const void *src, uint32_t len);
+
+#endif
@@ -36,6 +36,11 @@
 #include <stdlib.h>
 #include "macros.h"
 #include "bcm2835.h"
+#include "dma.h"
+#include "mmu.h"
+#include "irq.h"
+#include "timer.h"
+#include "emmc.h"
 
 #ifdef DEBUG2
 #define EMMC_DEBUG
@@ -63,6 +68,17 @@
 // Enable SDMA support
 //#define SDMA_SUPPORT
 
+// Move block data with the BCM DMA engine paced by the EMMC DREQ
+#define EMMC_DMA_SUPPORT
+
+// Queue transfers with sd_submit, moved along by the EMMC interrupt
+//  while the DMA engine carries the data
+#define SD_ASYNC_SUPPORT
+
+#if defined(SD_ASYNC_SUPPORT) && !defined(EMMC_DMA_SUPPORT)
+#error "SD_ASYNC_SUPPORT needs EMMC_DMA_SUPPORT"
+#endif
+
 // SDMA buffer address
 #define SDMA_BUFFER     0x6000
 #define SDMA_BUFFER_PA  (SDMA_BUFFER + 0xC0000000)
@@ -97,6 +113,7 @@ struct emmc_block_dev
   //	struct emmc_block_dev bd;
 	uint32_t card_supports_sdhc;
 	uint32_t card_supports_18v;
+	uint32_t card_supports_cmd23;
 	uint32_t card_ocr;
 	uint32_t card_rca;
 	uint32_t last_interrupt;
@@ -118,6 +135,8 @@ struct emmc_block_dev
 	int blocks_to_transfer;
 	size_t block_size;
 	int use_sdma;
+	int use_dma;
+	int dma_active;
 	int card_removal;
 	uint32_t base_clock;
 };
@@ -263,8 +282,11 @@ static char *err_irpts[] = { "CMD_TIMEOUT", "CMD_CRC", "CMD_END_BIT", "CMD_INDEX
 	"AUTO_CMD12", "ADMA", "TUNING", "RSVD" };
 #endif
 
-int sd_read(uint8_t *buf, uint32_t sector, uint8_t count);
-int sd_write(uint8_t *buf, uint32_t sector, uint8_t count);
+int sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
+int sd_write(uint8_t *buf, uint32_t sector, uint32_t count);
+
+// BLKSIZECNT only holds a 16 bit block count
+#define SD_MAX_BLOCKS		0xffff
 
 static uint32_t sd_commands[] = {
     SD_CMD_INDEX(0),
@@ -273,7 +295,7 @@ static uint32_t sd_commands[] = {
     SD_CMD_INDEX(3) | SD_RESP_R6,
     SD_CMD_INDEX(4),
     SD_CMD_INDEX(5) | SD_RESP_R4,
-    SD_CMD_INDEX(6) | SD_RESP_R1,
+    SD_CMD_INDEX(6) | SD_RESP_R1 | SD_DATA_READ,
     SD_CMD_INDEX(7) | SD_RESP_R1b,
     SD_CMD_INDEX(8) | SD_RESP_R7,
     SD_CMD_INDEX(9) | SD_RESP_R2,
@@ -452,7 +474,90 @@ static uint32_t sd_acommands[] = {
 
 #define SD_GET_CLOCK_DIVIDER_FAIL	0xffffffff
 
-uint64_t currentTime = 0;
+// Polls until stop_if_true holds or usec microseconds have passed
+#define TIMEOUT_WAIT(stop_if_true, usec)				\
+do {									\
+	uint64_t _start = bcm2835_st_read();				\
+	while(!(stop_if_true) && bcm2835_st_read() - _start < (usec))	\
+		;							\
+} while(0)
+
+// Most commands complete within this many microseconds, so waits
+//  spin this long before putting the core to sleep
+#define SD_SPIN_TIME		50
+
+static int sd_irq_registered = 0;
+
+#ifdef SD_ASYNC_SUPPORT
+// Steps of a queued transfer
+#define SD_ASYNC_IDLE		0
+#define SD_ASYNC_CMD23		1	// Block count sent
+#define SD_ASYNC_DATA		2	// Data command and DMA running
+#define SD_ASYNC_STOP		3	// CMD12 closing an open-ended transfer
+
+static int sd_async_state = SD_ASYNC_IDLE;
+static int sd_async_in_irq = 0;		// Set while sd_irq runs
+static void sd_async_step();
+#endif
+
+/**
+ * sd_irq - EMMC interrupt handler
+ *
+ * Moves a queued transfer to its next step. Otherwise
+ * only wakes the waiting core: the status stays in
+ * INTERRUPT for sd_wait_irpt and the line is masked
+ * again until the next wait.
+ */
+static void sd_irq(void *arg)
+{
+	(void)arg;
+#ifdef SD_ASYNC_SUPPORT
+	if(sd_async_state != SD_ASYNC_IDLE)
+	{
+		sd_async_in_irq = 1;
+		sd_async_step();
+		sd_async_in_irq = 0;
+		return;
+	}
+#endif
+	mmio_write(emmc_base + EMMC_IRPT_EN, 0);
+}
+
+/**
+ * sd_wait_irpt - Waits for bits in the INTERRUPT register
+ *
+ * @mask: INTERRUPT bits that end the wait.
+ * @timeout: Microseconds to give up after.
+ *
+ * Spins for SD_SPIN_TIME, then sleeps until the EMMC
+ * interrupt if IRQs are on. The caller reads and
+ * clears INTERRUPT as before.
+ */
+static void sd_wait_irpt(uint32_t mask, useconds_t timeout)
+{
+	uint64_t deadline = timer_now() + timeout;
+
+	TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & mask,
+		timeout < SD_SPIN_TIME ? timeout : SD_SPIN_TIME);
+
+	while(!(mmio_read(emmc_base + EMMC_INTERRUPT) & mask) &&
+	      timer_now() < deadline)
+	{
+		uint32_t cpsr = irq_save();
+		if(!sd_irq_registered || (cpsr & 0x80))
+		{
+			// Interrupts are off, keep polling
+			irq_restore(cpsr);
+			continue;
+		}
+		// Bit 15 only sums up the errors, each has its own enable
+		mmio_write(emmc_base + EMMC_IRPT_EN, 0xffff0000 | (mask & 0xffff));
+		if(!(mmio_read(emmc_base + EMMC_INTERRUPT) & mask))
+			timer_idle(deadline);
+		mmio_write(emmc_base + EMMC_IRPT_EN, 0);
+		irq_restore(cpsr);
+	}
+}
 
 static void sd_power_off()
 {
@@ -633,81 +738,53 @@ static uint32_t sd_get_clock_divider(uint32_t base_clock, uint32_t target_rate)
 {
     // TODO: implement use of preset value registers
 
-    uint32_t targetted_divisor = 0;
-    if(target_rate > base_clock)
-        targetted_divisor = 1;
-    else
-    {
-        targetted_divisor = base_clock / target_rate;
-        uint32_t mod = base_clock % target_rate;
-        if(mod)
-            targetted_divisor--;
-    }
-
-    // Decide on the clock mode to use
-
-    // Currently only 10-bit divided clock mode is supported
+    // The SD clock is base_clock / (2 * divisor), or base_clock for 0
+    uint32_t divisor = 0;
 
 #ifndef EMMC_ALLOW_OLD_SDHCI
-    if(hci_ver >= 2)
+    if(hci_ver < 2)
     {
+        printf("EMMC: unsupported host version\n");
+        return SD_GET_CLOCK_DIVIDER_FAIL;
+    }
 #endif
-        // HCI version 3 or greater supports 10-bit divided clock mode
-        // This requires a power-of-two divider
 
-        // Find the first bit set
-        int divisor = -1;
-        for(int first_bit = 31; first_bit >= 0; first_bit--)
+    if(target_rate < base_clock)
+    {
+        // Round up so the card is never clocked above target_rate
+        divisor = (base_clock + 2 * target_rate - 1) / (2 * target_rate);
+
+        if(hci_ver < 2)
         {
-            uint32_t bit_test = (1 << first_bit);
-            if(targetted_divisor & bit_test)
-            {
-                divisor = first_bit;
-                targetted_divisor &= ~bit_test;
-                if(targetted_divisor)
-                {
-                    // The divisor is not a power-of-two, increase it
-                    divisor++;
-                }
-                break;
-            }
+            // 8-bit divided clock mode only takes powers of two
+            uint32_t pow2 = 1;
+            while(pow2 < divisor)
+                pow2 <<= 1;
+            divisor = pow2;
+            if(divisor > 0x80)
+                divisor = 0x80;
         }
-
-        if(divisor == -1)
-            divisor = 31;
-        if(divisor >= 32)
-            divisor = 31;
-
-        if(divisor != 0)
-            divisor = (1 << (divisor - 1));
-
-        if(divisor >= 0x400)
+        // HCI version 3 or greater supports 10-bit divided clock mode
+        //  which takes any divisor
+        else if(divisor > 0x3ff)
             divisor = 0x3ff;
+    }
 
-        uint32_t freq_select = divisor & 0xff;
-        uint32_t upper_bits = (divisor >> 8) & 0x3;
-        uint32_t ret = (freq_select << 8) | (upper_bits << 6) | (0 << 5);
+    uint32_t freq_select = divisor & 0xff;
+    uint32_t upper_bits = (divisor >> 8) & 0x3;
+    uint32_t ret = (freq_select << 8) | (upper_bits << 6) | (0 << 5);
 
 #ifdef EMMC_DEBUG
-        int denominator = 1;
-        if(divisor != 0)
-            denominator = divisor * 2;
-        int actual_clock = base_clock / denominator;
-        printf("EMMC: base_clock: %i, target_rate: %i, divisor: %08x, "
-               "actual_clock: %i, ret: %08x\n", base_clock, target_rate,
-               divisor, actual_clock, ret);
-#endif
-
-        return ret;
-#ifndef EMMC_ALLOW_OLD_SDHCI
-    }
-    else
-    {
-        printf("EMMC: unsupported host version\n");
-        return SD_GET_CLOCK_DIVIDER_FAIL;
-    }
+    int denominator = 1;
+    if(divisor != 0)
+        denominator = divisor * 2;
+    int actual_clock = base_clock / denominator;
+    printf("EMMC: base_clock: %i, target_rate: %i, divisor: %08x, "
+           "actual_clock: %i, ret: %08x\n", base_clock, target_rate,
+           divisor, actual_clock, ret);
 #endif
 
+    return ret;
 }
 
 // Switch the clock rate whilst running
@@ -755,11 +832,7 @@ static int sd_reset_cmd()
     uint32_t control1 = mmio_read(emmc_base + EMMC_CONTROL1);
 	control1 |= SD_RESET_CMD;
 	mmio_write(emmc_base + EMMC_CONTROL1, control1);
-	//TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_CMD) == 0, 1000000);
-	currentTime = bcm2835_st_read();
-	while(bcm2835_st_read() - currentTime < 1000000) {
-	  if ((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_CMD) == 0) break;
-	}	
+	TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_CMD) == 0, 1000000);
 	if((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_CMD) != 0)
 	{
 		printf("EMMC: CMD line did not reset properly\n");
@@ -774,11 +847,7 @@ static int sd_reset_dat()
     uint32_t control1 = mmio_read(emmc_base + EMMC_CONTROL1);
 	control1 |= SD_RESET_DAT;
 	mmio_write(emmc_base + EMMC_CONTROL1, control1);
-	//	TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_DAT) == 0, 1000000);
-	currentTime = bcm2835_st_read();
-	while(bcm2835_st_read() - currentTime < 1000000) {
-	  if ((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_DAT) == 0) break;
-	}		
+	TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_DAT) == 0, 1000000);
 	if((mmio_read(emmc_base + EMMC_CONTROL1) & SD_RESET_DAT) != 0)
 	{
 		printf("EMMC: DAT line did not reset properly\n");
@@ -787,6 +856,131 @@ static int sd_reset_dat()
 	return 0;
 }
 
+#ifdef EMMC_DMA_SUPPORT
+// The data FIFO as seen by the DMA controller
+#define EMMC_DATA_BUS		(BCM2835_PERI_BUS_BASE + 0x300000 + EMMC_DATA)
+// Bytes per control block, lite channels stop at 65535
+#define EMMC_DMA_CHUNK		32768
+
+static int emmc_dma_channel = -1;
+static dma_cb *emmc_dma_cbs;
+static uint32_t emmc_dma_cb_count;
+
+// The FIFO is read and written in whole words, other buffers use PIO
+static int sd_suitable_for_dma_engine(void *buf)
+{
+    if((uintptr_t)buf & 0x3)
+        return 0;
+    else
+        return 1;
+}
+
+/**
+ * sd_dma_start - Points a DMA channel at the data FIFO
+ *
+ * @is_write: Nonzero to feed the card from edev->buf.
+ *
+ * Covers edev->blocks_to_transfer blocks. Returns -1
+ * if no channel or control blocks could be had, the
+ * caller then falls back to PIO.
+ */
+static int sd_dma_start(int is_write)
+{
+    uint8_t *buf = edev->buf;
+    uint32_t len = edev->blocks_to_transfer * edev->block_size;
+    uint32_t count = (len + EMMC_DMA_CHUNK - 1) / EMMC_DMA_CHUNK;
+    uint32_t i;
+
+    if(emmc_dma_channel < 0)
+    {
+        emmc_dma_channel = dma_channel_alloc(DMA_CHANNEL_ANY);
+        if(emmc_dma_channel < 0)
+            return -1;
+    }
+    if(count > emmc_dma_cb_count)
+    {
+        dma_cb *cbs = dma_cb_alloc(count);
+        if(!cbs)
+            return -1;
+        if(emmc_dma_cbs)
+            dma_cb_free(emmc_dma_cbs);
+        emmc_dma_cbs = cbs;
+        emmc_dma_cb_count = count;
+    }
+
+    // Partial lines at the edges are written back by dcache_invalidate,
+    //  so FatFs buffers need no cache line alignment
+    if(is_write)
+        dcache_clean(buf, len);
+    else
+        dcache_invalidate(buf, len);
+
+    for(i = 0; i < count; i++)
+    {
+        dma_cb *cb = &emmc_dma_cbs[i];
+        uint32_t n = len - i * EMMC_DMA_CHUNK;
+        if(n > EMMC_DMA_CHUNK)
+            n = EMMC_DMA_CHUNK;
+
+        if(is_write)
+        {
+            cb->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_EMMC) |
+                BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC |
+                BCM2835_DMA_TI_WAIT_RESP;
+            cb->source_ad = dma_bus_address(buf + i * EMMC_DMA_CHUNK);
+            cb->dest_ad = EMMC_DATA_BUS;
+        }
+        else
+        {
+            cb->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_EMMC) |
+                BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_INC |
+                BCM2835_DMA_TI_WAIT_RESP;
+            cb->source_ad = EMMC_DATA_BUS;
+            cb->dest_ad = dma_bus_address(buf + i * EMMC_DMA_CHUNK);
+        }
+        cb->txfr_len = n;
+        cb->stride = 0;
+        dma_cb_link(cb, (i + 1 < count) ? &emmc_dma_cbs[i + 1] : 0);
+    }
+
+    dma_start(emmc_dma_channel, emmc_dma_cbs);
+    edev->dma_active = 1;
+    return 0;
+}
+
+/**
+ * sd_dma_finish - Settles the DMA side of a data command
+ *
+ * @is_write: As passed to sd_dma_start.
+ *
+ * Stops the channel if the command failed and marks
+ * the command failed if the channel reported an error.
+ * Does not print, as the EMMC interrupt calls it too.
+ * Returns -1 on a DMA error, else 0.
+ */
+static int sd_dma_finish(int is_write)
+{
+    int ret = 0;
+
+    if(SUCCESS(edev))
+    {
+        if(dma_wait(emmc_dma_channel) < 0)
+        {
+            edev->last_cmd_success = 0;
+            ret = -1;
+        }
+    }
+    else
+        dma_abort(emmc_dma_channel);
+
+    // Drop lines speculatively fetched while the DMA was writing
+    if(!is_write)
+        dcache_invalidate(edev->buf, edev->blocks_to_transfer * edev->block_size);
+    edev->dma_active = 0;
+    return ret;
+}
+#endif
+
 static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t timeout)
 {
     edev->last_cmd_reg = cmd_reg;
@@ -795,8 +989,12 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
     // This is as per HCSS 3.7.1.1/3.7.2.2
 
     // Check Command Inhibit
-    while(mmio_read(emmc_base + EMMC_STATUS) & 0x1)
-        bcm2835_delayMicroseconds(1000);
+    TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_STATUS) & 0x1) == 0, timeout);
+    if(mmio_read(emmc_base + EMMC_STATUS) & 0x1)
+    {
+        printf("SD: timeout waiting for command inhibit\n");
+        return;
+    }
 
     // Is the command with busy?
     if((cmd_reg & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B)
@@ -809,8 +1007,12 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
             // Not an abort command
 
             // Wait for the data line to be free
-            while(mmio_read(emmc_base + EMMC_STATUS) & 0x2)
-                bcm2835_delayMicroseconds(1000);
+            TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_STATUS) & 0x2) == 0, timeout);
+            if(mmio_read(emmc_base + EMMC_STATUS) & 0x2)
+            {
+                printf("SD: timeout waiting for data inhibit\n");
+                return;
+            }
         }
     }
 
@@ -856,17 +1058,21 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
         cmd_reg |= SD_CMD_DMA;
     }
 
+    // Or let the DMA engine empty/fill the FIFO as the card goes
+    int is_dma = 0;
+#ifdef EMMC_DMA_SUPPORT
+    if((cmd_reg & SD_CMD_ISDATA) && edev->use_dma && (is_sdma == 0))
+    {
+        if(sd_dma_start((cmd_reg & SD_CMD_DAT_DIR_CH) == 0) == 0)
+            is_dma = 1;
+    }
+#endif
+
     // Set command reg
     mmio_write(emmc_base + EMMC_CMDTM, cmd_reg);
 
-    bcm2835_delayMicroseconds(2000);
-
     // Wait for command complete interrupt
-    //    TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x8001, timeout);
-    currentTime = bcm2835_st_read();
-    while(bcm2835_st_read() - currentTime < timeout) {
-      if (mmio_read(emmc_base + EMMC_INTERRUPT) & 0x8001) break;
-    }	        
+    sd_wait_irpt(0x8001, timeout);
     uint32_t irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
 
     // Clear command complete status
@@ -883,8 +1089,6 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
         return;
     }
 
-    bcm2835_delayMicroseconds(2000);
-
     // Get response data
     switch(cmd_reg & SD_CMD_RSPNS_TYPE_MASK)
     {
@@ -902,7 +1106,7 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
     }
 
     // If with data, wait for the appropriate interrupt
-    if((cmd_reg & SD_CMD_ISDATA) && (is_sdma == 0))
+    if((cmd_reg & SD_CMD_ISDATA) && (is_sdma == 0) && (is_dma == 0))
     {
         uint32_t wr_irpt;
         int is_write = 0;
@@ -923,11 +1127,7 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
 				printf("SD: multi block transfer, awaiting block %i ready\n",
 				cur_block);
 #endif
-			//            TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & (wr_irpt | 0x8000), timeout);
-	    currentTime = bcm2835_st_read();
-	    while(bcm2835_st_read() - currentTime < timeout) {
-	      if (mmio_read(emmc_base + EMMC_INTERRUPT) & (wr_irpt | 0x8000)) break;
-	    }	    			
+            sd_wait_irpt(wr_irpt | 0x8000, timeout);
             irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
             mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0000 | wr_irpt);
 
@@ -976,11 +1176,7 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
             mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0002);
         else
         {
-	  //            TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x8002, timeout);
-	    currentTime = bcm2835_st_read();
-	    while(bcm2835_st_read() - currentTime < timeout) {
-	      if (mmio_read(emmc_base + EMMC_INTERRUPT) & 0x8002) break;
-	    }	    	  	  
+            sd_wait_irpt(0x8002, timeout);
             irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
             mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff0002);
 
@@ -1008,11 +1204,7 @@ static void sd_issue_command_int(uint32_t cmd_reg, uint32_t argument, useconds_t
             mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff000a);
         else
         {
-	  //            TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x800a, timeout);
-	    currentTime = bcm2835_st_read();
-	    while(bcm2835_st_read() - currentTime < timeout) {
-	      if (mmio_read(mmio_read(emmc_base + EMMC_INTERRUPT) & 0x800a)) break;
-	    }	    	  	    	  
+            sd_wait_irpt(0x800a, timeout);
             irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
             mmio_write(emmc_base + EMMC_INTERRUPT, 0xffff000a);
 
@@ -1296,6 +1488,8 @@ static void sd_issue_command(uint32_t command, uint32_t argument, useconds_t tim
 #endif
 }
 
+static void sd_switch_bus_speed();
+
 int sd_card_init()
 {
     // Check the sanity of the sd_commands and sd_acommands structures
@@ -1356,11 +1550,7 @@ int sd_card_init()
 	control1 &= ~(1 << 2);
 	control1 &= ~(1 << 0);
 	mmio_write(emmc_base + EMMC_CONTROL1, control1);
-	//	TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_CONTROL1) & (0x7 << 24)) == 0, 1000000);
-	currentTime = bcm2835_st_read();
-	while(bcm2835_st_read() - currentTime < 1000000) {
-	  if ((mmio_read(emmc_base + EMMC_CONTROL1) & (0x7 << 24)) == 0) break;
-	}	    	  	    		
+	TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_CONTROL1) & (0x7 << 24)) == 0, 1000000);
 	if((mmio_read(emmc_base + EMMC_CONTROL1) & (0x7 << 24)) != 0)
 	{
 		printf("EMMC: controller did not reset properly\n");
@@ -1384,11 +1574,7 @@ int sd_card_init()
 #ifdef EMMC_DEBUG
 	printf("EMMC: checking for an inserted card\n");
 #endif
-	//    TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_STATUS) & (1 << 16), 500000);
-	currentTime = bcm2835_st_read();
-	while(bcm2835_st_read() - currentTime < 500000) {
-	  if (mmio_read(emmc_base + EMMC_STATUS) & (1 << 16)) break;
-	}	    	  	    			
+	TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_STATUS) & (1 << 16), 500000);
 	uint32_t status_reg = mmio_read(emmc_base + EMMC_STATUS);
 	if((status_reg & (1 << 16)) == 0)
 	{
@@ -1428,11 +1614,7 @@ int sd_card_init()
 
 	control1 |= (7 << 16);		// data timeout = TMCLK * 2^10
 	mmio_write(emmc_base + EMMC_CONTROL1, control1);
-	//	TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_CONTROL1) & 0x2, 0x1000000);
-	currentTime = bcm2835_st_read();
-	while(bcm2835_st_read() - currentTime < 0x1000000) {
-	  if (mmio_read(emmc_base + EMMC_CONTROL1) & 0x2) break;
-	}	    	  	    				
+	TIMEOUT_WAIT(mmio_read(emmc_base + EMMC_CONTROL1) & 0x2, 0x1000000);
 	if((mmio_read(emmc_base + EMMC_CONTROL1) & 0x2) == 0)
 	{
 		printf("EMMC: controller's clock did not stabilise within 1 second\n");
@@ -1457,8 +1639,11 @@ int sd_card_init()
 	printf("EMMC: SD clock enabled\n");
 #endif
 
-	// Mask off sending interrupts to the ARM
+	// Mask off sending interrupts to the ARM, waits enable them
+	//  one at a time once the handler is in place
 	mmio_write(emmc_base + EMMC_IRPT_EN, 0);
+	if(!sd_irq_registered)
+		sd_irq_registered = (irq_register(BCM2835_IRQ_EMMC, sd_irq, 0) == 0);
 	// Reset interrupts
 	mmio_write(emmc_base + EMMC_INTERRUPT, 0xffffffff);
 	// Have all interrupts sent to the INTERRUPT register
@@ -1853,6 +2038,8 @@ int sd_card_init()
 	uint32_t sd_spec3 = (scr0 >> (47 - 32)) & 0x1;
 	uint32_t sd_spec4 = (scr0 >> (42 - 32)) & 0x1;
 	edev->scr->sd_bus_widths = (scr0 >> (48 - 32)) & 0xf;
+	// CMD_SUPPORT bit 33 - SET_BLOCK_COUNT before multi-block transfers
+	edev->card_supports_cmd23 = (scr0 >> (33 - 32)) & 0x1;
 	if(sd_spec == 0)
         edev->scr->sd_version = SD_VER_1;
     else if(sd_spec == 1)
@@ -1912,6 +2099,8 @@ int sd_card_init()
         }
 #endif
     }
+
+    sd_switch_bus_speed();
     
 #ifdef EMMC_DEBUG
 	printf("SD: found a valid version %s SD card\n", sd_versions[edev->scr->sd_version]);    
@@ -1924,6 +2113,122 @@ int sd_card_init()
 	return 0;
 }
 
+// CMD6 switch function arguments, PLSS 4.3.10
+#define SD_SWITCH_CHECK		0x00fffff0
+#define SD_SWITCH_SET		0x80fffff0
+// Access mode functions in group 1
+#define SD_ACCESS_SDR25		1		// High Speed, 50 MHz
+#define SD_ACCESS_SDR50		2		// UHS-I, 100 MHz at 1.8V
+
+/**
+ * sd_switch_function - Queries or sets the group 1 function with CMD6
+ *
+ * @mode: SD_SWITCH_CHECK or SD_SWITCH_SET.
+ * @function: Access mode function number.
+ *
+ * Returns 0 if the card supports the function and
+ * reports it as selected in the 512 bit status.
+ */
+static int sd_switch_function(uint32_t mode, uint32_t function)
+{
+    uint8_t status[64] __attribute__((aligned(4)));
+
+    edev->buf = status;
+    edev->block_size = 64;
+    edev->blocks_to_transfer = 1;
+    sd_issue_command(SWITCH_FUNC, mode | function, 500000);
+    edev->block_size = 512;
+    if(FAIL(edev))
+    {
+        // Cards before SD 1.1 reject CMD6, clear up after the failed read
+        sd_reset_cmd();
+        sd_reset_dat();
+        return -1;
+    }
+
+    // Status is big-endian: group 1 support in bits 415:400,
+    //  group 1 selection in bits 379:376
+    uint32_t support = (status[12] << 8) | status[13];
+    uint32_t selected = status[16] & 0xf;
+#ifdef EMMC_DEBUG
+    printf("SD: CMD6 %08x group 1 support %04x selected %x\n",
+           (unsigned int)(mode | function), (unsigned int)support,
+           (unsigned int)selected);
+#endif
+    if(!(support & (1 << function)) || selected != function)
+        return -1;
+    return 0;
+}
+
+/**
+ * sd_switch_bus_speed - Moves the card past the default 25 MHz
+ *
+ * Tries SDR50 when the 1.8V switch worked and the
+ * host runs it without tuning, then High Speed.
+ * The card stays at SD_CLOCK_NORMAL if neither works.
+ */
+static void sd_switch_bus_speed()
+{
+    uint32_t function = SD_ACCESS_SDR25;
+    uint32_t rate = SD_CLOCK_HIGH;
+
+    // CMD6 arrived with SD 1.1
+    if(edev->scr->sd_version < SD_VER_1_1)
+        return;
+
+#ifdef SD_1_8V_SUPPORT
+    // SDR50 support without a tuning requirement, HCSS 2.2.26
+    if(edev->card_supports_18v && !edev->failed_voltage_switch &&
+       (capabilities_1 & (1 << 0)) && !(capabilities_1 & (1 << 13)))
+    {
+        if(sd_switch_function(SD_SWITCH_CHECK, SD_ACCESS_SDR50) == 0)
+        {
+            function = SD_ACCESS_SDR50;
+            rate = SD_CLOCK_100;
+        }
+    }
+#endif
+
+    if(function == SD_ACCESS_SDR25 &&
+       sd_switch_function(SD_SWITCH_CHECK, SD_ACCESS_SDR25) != 0)
+        return;
+    if(sd_switch_function(SD_SWITCH_SET, function) != 0)
+    {
+        printf("SD: switch to %i Hz mode failed\n", (int)rate);
+        return;
+    }
+
+    // The card changes timing within 8 clocks of the status block
+    bcm2835_delayMicroseconds(10);
+
+    if(function == SD_ACCESS_SDR50)
+    {
+        // UHS mode select in Host Control 2
+        uint32_t control2 = mmio_read(emmc_base + EMMC_CONTROL2);
+        control2 &= ~(7 << 16);
+        control2 |= (SD_ACCESS_SDR50 << 16);
+        mmio_write(emmc_base + EMMC_CONTROL2, control2);
+    }
+    else
+    {
+        // High speed enable
+        uint32_t control0 = mmio_read(emmc_base + EMMC_CONTROL0);
+        control0 |= (1 << 2);
+        mmio_write(emmc_base + EMMC_CONTROL0, control0);
+    }
+
+    if(sd_switch_clock_rate(edev->base_clock, rate) != 0)
+    {
+        // The card is in the new mode already, it still works slower
+        printf("SD: staying at %i Hz\n", (int)SD_CLOCK_NORMAL);
+        return;
+    }
+
+#ifdef EMMC_DEBUG
+    printf("SD: bus speed now %i Hz\n", (int)rate);
+#endif
+}
+
 static int sd_ensure_data_mode()
 {
 
@@ -2011,7 +2316,7 @@ static int sd_ensure_data_mode()
 }
 
 #ifdef SDMA_SUPPORT
-// We only support DMA transfers to buffers aligned on a 4 kiB boundary
+// We only support SDMA transfers to buffers aligned on a 4 kiB boundary
 static int sd_suitable_for_dma(void *buf)
 {
     if((uintptr_t)buf & 0xfff)
@@ -2061,6 +2366,10 @@ static int sd_do_data_command(int is_write, uint8_t *buf, size_t buf_size, uint3
             command = READ_SINGLE_BLOCK;
     }
 
+	// Multi-block transfers are either pre-counted with CMD23 or
+	//  closed with an explicit CMD12 once the data is through
+	int multi = edev->blocks_to_transfer > 1;
+
 	int retry_count = 0;
 	int max_retries = 3;
 	while(retry_count < max_retries)
@@ -2079,8 +2388,34 @@ static int sd_do_data_command(int is_write, uint8_t *buf, size_t buf_size, uint3
 #else
         edev->use_sdma = 0;
 #endif
+#ifdef EMMC_DMA_SUPPORT
+        // Likewise the DMA engine, a failed transfer is retried with PIO
+        edev->use_dma = (retry_count == 0) && sd_suitable_for_dma_engine(buf);
+#endif
+
+        if(multi && edev->card_supports_cmd23)
+        {
+            sd_issue_command(SET_BLOCK_COUNT, edev->blocks_to_transfer, 500000);
+            if(FAIL(edev))
+            {
+                printf("SD: CMD23 failed, falling back to CMD12\n");
+                edev->card_supports_cmd23 = 0;
+            }
+        }
 
         sd_issue_command(command, block_no, 5000000);
+#ifdef EMMC_DMA_SUPPORT
+        if(edev->dma_active && sd_dma_finish(is_write) < 0)
+            printf("SD: DMA error during CMD%i\n", command);
+        edev->use_dma = 0;
+#endif
+
+        if(SUCCESS(edev) && multi && !edev->card_supports_cmd23)
+        {
+            sd_issue_command(STOP_TRANSMISSION, 0, 500000);
+            if(FAIL(edev))
+                printf("SD: no response from CMD12 after CMD%i\n", command);
+        }
 
         if(SUCCESS(edev))
             break;
@@ -2104,19 +2439,27 @@ static int sd_do_data_command(int is_write, uint8_t *buf, size_t buf_size, uint3
     return 0;
 }
 
-int sd_read(uint8_t *buf, uint32_t sector, uint8_t count)  
+int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
 {
-  size_t byte_count = count * 512;
+  uint32_t done = 0;
+  // Queued transfers go first and leave the controller idle
+  sd_queue_drain();
   // Check the status of the card
   if(sd_ensure_data_mode() != 0)
     return -1;
 
 #ifdef EMMC_DEBUG
-  printf("SD: read() card ready, reading from block %u\n", sector);
+  printf("SD: read() card ready, reading %u blocks from block %u\n", count, sector);
 #endif
 
-  if(sd_do_data_command(0, buf, byte_count, sector) < 0)
-    return -1;
+  while(done < count) {
+    uint32_t n = count - done;
+    if(n > SD_MAX_BLOCKS)
+      n = SD_MAX_BLOCKS;
+    if(sd_do_data_command(0, buf + done * 512, n * 512, sector + done) < 0)
+      return -1;
+    done += n;
+  }
 
 #ifdef EMMC_DEBUG
   printf("SD: data read successful\n");
@@ -2126,24 +2469,357 @@ int sd_read(uint8_t *buf, uint32_t sector, uint8_t count)
 }
 
 #ifdef SD_WRITE_SUPPORT
-int sd_write(uint8_t *buf, uint32_t sector, uint8_t count)
+int sd_write(uint8_t *buf, uint32_t sector, uint32_t count)
 {
-  size_t byte_count = count * 512;  
+  uint32_t done = 0;
+  sd_queue_drain();
   // Check the status of the card
   if(sd_ensure_data_mode() != 0)
     return -1;
 
 #ifdef EMMC_DEBUG
-  printf("SD: write() card ready, reading from block %u\n", sector);
+  printf("SD: write() card ready, writing %u blocks to block %u\n", count, sector);
 #endif
 
-  if(sd_do_data_command(1, buf, byte_count, sector) < 0)
-    return -1;
+  while(done < count) {
+    uint32_t n = count - done;
+    if(n > SD_MAX_BLOCKS)
+      n = SD_MAX_BLOCKS;
+    if(sd_do_data_command(1, buf + done * 512, n * 512, sector + done) < 0)
+      return -1;
+    done += n;
+  }
 
 #ifdef EMMC_DEBUG
-  printf("SD: write read successful\n");
+  printf("SD: write successful\n");
 #endif
 
   return count;
 }
 #endif
+
+#ifdef SD_ASYNC_SUPPORT
+static sd_request *sd_queue_head = NULL;
+static sd_request *sd_queue_tail = NULL;
+// INTERRUPT bits the current step still waits for
+static uint32_t sd_async_pending = 0;
+// Blocks moved by the data command under way
+static uint32_t sd_async_blocks = 0;
+// Set after a failed transfer, the card state is checked first
+static int sd_async_recover = 1;
+// Set after a failed transfer until the CMD and DAT lines are reset
+static int sd_async_lines_dirty = 0;
+
+/**
+ * sd_async_command - Issues a command without waiting for it
+ *
+ * @cmd_reg: Value for CMDTM.
+ * @argument: Value for ARG1.
+ * @expect: INTERRUPT bits that finish this step.
+ *
+ * The previous step has completed, so the inhibit bits
+ * clear at once. Returns -1 if they do not.
+ */
+static int sd_async_command(uint32_t cmd_reg, uint32_t argument, uint32_t expect)
+{
+    TIMEOUT_WAIT((mmio_read(emmc_base + EMMC_STATUS) & 0x3) == 0, 1000);
+    if(mmio_read(emmc_base + EMMC_STATUS) & 0x3)
+        return -1;
+
+    edev->last_cmd_reg = cmd_reg;
+    sd_async_pending = expect;
+    mmio_write(emmc_base + EMMC_BLKSIZECNT,
+        edev->block_size | (edev->blocks_to_transfer << 16));
+    mmio_write(emmc_base + EMMC_ARG1, argument);
+    mmio_write(emmc_base + EMMC_IRPT_EN, 0xffff0000 | expect);
+    mmio_write(emmc_base + EMMC_CMDTM, cmd_reg);
+    return 0;
+}
+
+// Starts the DMA channel and the read or write command
+static int sd_async_data(sd_request *req)
+{
+    uint32_t block_no = req->sector + req->progress;
+    int multi = sd_async_blocks > 1;
+    int command;
+
+    if(!edev->card_supports_sdhc)
+        block_no *= 512;
+    if(req->is_write)
+        command = multi ? WRITE_MULTIPLE_BLOCK : WRITE_BLOCK;
+    else
+        command = multi ? READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK;
+
+    if(sd_dma_start(req->is_write) < 0)
+        return -1;
+    if(sd_async_command(sd_commands[command], block_no,
+        SD_COMMAND_COMPLETE | SD_TRANSFER_COMPLETE) < 0)
+        return -1;
+    sd_async_state = SD_ASYNC_DATA;
+    return 0;
+}
+
+// Starts the next run of at most SD_MAX_BLOCKS blocks of a request
+static int sd_async_chunk(sd_request *req)
+{
+    uint32_t n = req->count - req->progress;
+
+    if(n > SD_MAX_BLOCKS)
+        n = SD_MAX_BLOCKS;
+    edev->buf = req->buf + req->progress * 512;
+    edev->blocks_to_transfer = n;
+    sd_async_blocks = n;
+
+    if(n > 1 && edev->card_supports_cmd23)
+    {
+        if(sd_async_command(sd_commands[SET_BLOCK_COUNT], n, SD_COMMAND_COMPLETE) < 0)
+            return -1;
+        sd_async_state = SD_ASYNC_CMD23;
+        return 0;
+    }
+    return sd_async_data(req);
+}
+
+static void sd_async_start(sd_request *req);
+
+/**
+ * sd_async_complete - Hands the head of the queue back
+ *
+ * @status: 0 on success, -1 on failure.
+ *
+ * Calls the request's callback, then starts the
+ * next request unless the callback already did.
+ */
+static void sd_async_complete(int status)
+{
+    sd_request *req = sd_queue_head;
+
+    sd_queue_head = req->next;
+    if(!sd_queue_head)
+        sd_queue_tail = NULL;
+    sd_async_state = SD_ASYNC_IDLE;
+    sd_async_pending = 0;
+    mmio_write(emmc_base + EMMC_IRPT_EN, 0);
+
+    req->status = status;
+    if(req->done)
+        req->done(req);
+
+    if(sd_queue_head && sd_async_state == SD_ASYNC_IDLE)
+        sd_async_start(sd_queue_head);
+}
+
+/**
+ * sd_async_fail - Abandons the head of the queue
+ *
+ * @irpts: INTERRUPT value with the error bits, or 0.
+ *
+ * Only stops the DMA channel, as it may run in the
+ * interrupt. The lines are reset and the card state
+ * is checked again in thread context, before the next
+ * request or when the queue is drained. There is no
+ * retry, the caller sees status -1 and may submit
+ * again. In the interrupt the rest of the queue fails
+ * as well.
+ */
+static void sd_async_fail(uint32_t irpts)
+{
+    mmio_write(emmc_base + EMMC_IRPT_EN, 0);
+    mmio_write(emmc_base + EMMC_INTERRUPT, 0xffffffff);
+    edev->last_error = irpts & 0xffff0000;
+    edev->last_interrupt = irpts;
+
+    if(edev->dma_active)
+    {
+        edev->last_cmd_success = 0;
+        sd_dma_finish(sd_queue_head->is_write);
+    }
+    sd_async_lines_dirty = 1;
+    sd_async_recover = 1;
+    sd_async_complete(-1);
+}
+
+/**
+ * sd_async_reset_lines - Resets the lines after a failed transfer
+ *
+ * Waits for the controller, so never called from
+ * the interrupt.
+ */
+static void sd_async_reset_lines()
+{
+    if(!sd_async_lines_dirty)
+        return;
+    sd_reset_cmd();
+    sd_reset_dat();
+    sd_async_lines_dirty = 0;
+}
+
+static void sd_async_start(sd_request *req)
+{
+    if(sd_async_recover)
+    {
+        // Recovery may reinitialise the card, which allocates
+        // and waits, so only sd_submit and sd_queue_drain do it
+        if(sd_async_in_irq)
+        {
+            sd_async_complete(-1);
+            return;
+        }
+        // Polls, the caller has IRQs masked
+        sd_async_reset_lines();
+        if(sd_ensure_data_mode() != 0)
+        {
+            sd_async_complete(-1);
+            return;
+        }
+        sd_async_recover = 0;
+    }
+    if(sd_async_chunk(req) < 0)
+        sd_async_fail(0);
+}
+
+/**
+ * sd_async_step - Advances the transfer at the head of the queue
+ *
+ * Called from the EMMC interrupt, or polled by
+ * sd_queue_drain while IRQs are masked. Data and
+ * command timeouts raise error interrupts, so every
+ * step ends in one of the two.
+ */
+static void sd_async_step()
+{
+    sd_request *req = sd_queue_head;
+    uint32_t irpts = mmio_read(emmc_base + EMMC_INTERRUPT);
+
+    if(irpts & 0xffff0000)
+    {
+        sd_async_fail(irpts);
+        return;
+    }
+    irpts &= sd_async_pending;
+    if(irpts == 0)
+        return;
+
+    mmio_write(emmc_base + EMMC_INTERRUPT, irpts);
+    sd_async_pending &= ~irpts;
+    if(sd_async_pending)
+    {
+        mmio_write(emmc_base + EMMC_IRPT_EN, 0xffff0000 | sd_async_pending);
+        return;
+    }
+
+    switch(sd_async_state)
+    {
+        case SD_ASYNC_CMD23:
+            if(sd_async_data(req) < 0)
+                sd_async_fail(0);
+            return;
+
+        case SD_ASYNC_DATA:
+            edev->last_cmd_success = 1;
+            sd_dma_finish(req->is_write);
+            if(FAIL(edev))
+            {
+                sd_async_fail(0);
+                return;
+            }
+            req->progress += sd_async_blocks;
+            if(sd_async_blocks > 1 && !edev->card_supports_cmd23)
+            {
+                // Transfer complete of an R1b command marks the end of busy
+                if(sd_async_command(sd_commands[STOP_TRANSMISSION], 0,
+                    SD_COMMAND_COMPLETE | SD_TRANSFER_COMPLETE) < 0)
+                    sd_async_fail(0);
+                else
+                    sd_async_state = SD_ASYNC_STOP;
+                return;
+            }
+            break;
+
+        case SD_ASYNC_STOP:
+            break;
+    }
+
+    if(req->progress < req->count)
+    {
+        if(sd_async_chunk(req) < 0)
+            sd_async_fail(0);
+        return;
+    }
+    sd_async_complete(0);
+}
+
+int sd_submit(sd_request *req)
+{
+    uint32_t cpsr;
+
+    if(!edev || req->count == 0 || !sd_suitable_for_dma_engine(req->buf))
+        return -1;
+    // Invalidating a shared edge line could undo CPU writes made meanwhile
+    if((uint32_t)req->buf & (CACHE_LINE_SIZE - 1))
+        return -1;
+#ifndef SD_WRITE_SUPPORT
+    if(req->is_write)
+        return -1;
+#endif
+
+    req->next = NULL;
+    req->status = 1;
+    req->progress = 0;
+
+    cpsr = irq_save();
+    if(sd_queue_tail)
+        sd_queue_tail->next = req;
+    else
+        sd_queue_head = req;
+    sd_queue_tail = req;
+    if(sd_queue_head == req && sd_async_state == SD_ASYNC_IDLE)
+        sd_async_start(req);
+    irq_restore(cpsr);
+    return 0;
+}
+
+int sd_queue_busy()
+{
+    return sd_queue_head != NULL;
+}
+
+void sd_queue_drain()
+{
+    uint32_t cpsr;
+
+    while(sd_queue_head)
+    {
+        cpsr = irq_save();
+        if(sd_queue_head)
+        {
+            // Nobody else takes the interrupt with IRQs off
+            if(!sd_irq_registered || (cpsr & 0x80))
+                sd_async_step();
+            else
+                wait_for_interrupt();
+        }
+        irq_restore(cpsr);
+    }
+
+    // Leave the lines usable for the synchronous commands that follow
+    cpsr = irq_save();
+    sd_async_reset_lines();
+    irq_restore(cpsr);
+}
+#else
+int sd_submit(sd_request *req)
+{
+    (void)req;
+    return -1;
+}
+
+int sd_queue_busy()
+{
+    return 0;
+}
+
+void sd_queue_drain()
+{
+}
+#endif
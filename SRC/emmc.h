@@ -22,6 +22,55 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#ifndef EMMC_H
+#define EMMC_H
+
 int sd_card_init();
-int sd_read(uint8_t *buf, uint32_t sector, uint8_t count);
-int sd_write(uint8_t *buf, uint32_t sector, uint8_t count);
+int sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
+int sd_write(uint8_t *buf, uint32_t sector, uint32_t count);
+
+struct sd_request;
+typedef void (*sd_request_callback)(struct sd_request *req);
+
+// A block transfer queued with sd_submit
+typedef struct sd_request {
+	struct sd_request *next;
+	uint8_t *buf;			// Cache line aligned
+	uint32_t sector;
+	uint32_t count;
+	int is_write;
+	volatile int status;		// 1 while queued, then 0 or -1
+	sd_request_callback done;	// Called from the EMMC interrupt
+	void *arg;
+	uint32_t progress;		// Blocks already moved, private
+} sd_request;
+
+/**
+ * sd_submit - Queues a block transfer
+ *
+ * @req: Filled-in request, must stay valid until
+ *       req->done has been called.
+ *
+ * The EMMC interrupt moves the queue along, one
+ * DMA transfer after another, and calls req->done
+ * with req->status set. Returns 0 once queued and
+ * -1 if the card or buffer cannot take it. The CPU
+ * keeps running meanwhile, so buf must start on a
+ * cache line and not share lines with other data.
+ */
+int sd_submit(sd_request *req);
+
+/**
+ * sd_queue_busy - Checks for queued transfers
+ */
+int sd_queue_busy();
+
+/**
+ * sd_queue_drain - Waits until every queued transfer is done
+ *
+ * sd_read and sd_write call this first. With IRQs
+ * masked the queue is driven by polling instead.
+ */
+void sd_queue_drain();
+
+#endif
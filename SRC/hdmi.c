@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include "hdmi.h"
 #include "bcm2835.h"
+#include "mmu.h"
 
 // Assembly Macros
 #include "macros.h"
@@ -50,6 +51,7 @@ void hdmi_init()
   bcm2835_mail_read(1);
 
   framebuffer = GET32(0x40040020);
+  mmu_set_bufferable(framebuffer, GET32(0x40040024));
 
   cursor_row = 0;
   cursor_column = 0;        
@@ -0,0 +1,28 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+// Initial module archive linked into the kernel image, built
+// from INITFS by build.sh, see SRC/pak.h and pak_mount_memory.
+
+.section ".rodata.initfs", "a"
+.balign 4
+
+.globl initfs_start
+initfs_start:
+.incbin "OBJ/initfs.pak"
+
+.globl initfs_end
+initfs_end:
@@ -0,0 +1,137 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdint.h>
+#include "irq.h"
+#include "bcm2835.h"
+
+// Assembly Macros
+#include "macros.h"
+
+#define IRQ_REG(offset) (BCM2835_IRQ_BASE + (offset))
+
+static struct {
+  irq_handler_t handler;
+  void *arg;
+} irq_handlers[BCM2835_IRQ_COUNT];
+
+static const char *exception_names[] = {
+  "Undefined instruction",
+  "Prefetch abort",
+  "Data abort",
+  "Unexpected exception",
+};
+
+/**
+ * irq_enable_source - Unmasks a source in the controller
+ *
+ * @source: A bcm2835IRQSource number.
+ * @enable: Non-zero to unmask, zero to mask.
+ */
+static void irq_enable_source(uint32_t source, int enable)
+{
+  uint32_t bit = 1 << (source & 31);
+
+  if(source < 32)
+    mmio_write(IRQ_REG(enable ? BCM2835_IRQ_ENABLE1 : BCM2835_IRQ_DISABLE1), bit);
+  else if(source < 64)
+    mmio_write(IRQ_REG(enable ? BCM2835_IRQ_ENABLE2 : BCM2835_IRQ_DISABLE2), bit);
+  else
+    mmio_write(IRQ_REG(enable ? BCM2835_IRQ_ENABLE_BASIC : BCM2835_IRQ_DISABLE_BASIC), bit);
+}
+
+void irq_init()
+{
+  mmio_write(IRQ_REG(BCM2835_IRQ_FIQ_CONTROL), 0);
+  mmio_write(IRQ_REG(BCM2835_IRQ_DISABLE1), 0xffffffff);
+  mmio_write(IRQ_REG(BCM2835_IRQ_DISABLE2), 0xffffffff);
+  mmio_write(IRQ_REG(BCM2835_IRQ_DISABLE_BASIC), 0xffffffff);
+
+  enable_irq();
+}
+
+int irq_register(uint32_t source, irq_handler_t handler, void *arg)
+{
+  uint32_t cpsr;
+
+  if(source >= BCM2835_IRQ_COUNT || handler == 0 || irq_handlers[source].handler)
+    return -1;
+
+  cpsr = irq_save();
+  irq_handlers[source].handler = handler;
+  irq_handlers[source].arg = arg;
+  irq_enable_source(source, 1);
+  irq_restore(cpsr);
+
+  return 0;
+}
+
+void irq_unregister(uint32_t source)
+{
+  uint32_t cpsr;
+
+  if(source >= BCM2835_IRQ_COUNT)
+    return;
+
+  cpsr = irq_save();
+  irq_enable_source(source, 0);
+  irq_handlers[source].handler = 0;
+  irq_handlers[source].arg = 0;
+  irq_restore(cpsr);
+}
+
+/**
+ * irq_dispatch_bank - Runs the handlers for one pending register
+ *
+ * @pending: Pending bits of the bank.
+ * @first: Source number of bit 0.
+ */
+static void irq_dispatch_bank(uint32_t pending, uint32_t first)
+{
+  uint32_t source;
+
+  while(pending) {
+    source = first + __builtin_ctz(pending);
+    pending &= pending - 1;
+
+    if(irq_handlers[source].handler)
+      irq_handlers[source].handler(irq_handlers[source].arg);
+    else
+      irq_enable_source(source, 0);
+  }
+}
+
+void irq_dispatch()
+{
+  // Bits above 7 of the basic register mirror the GPU banks
+  irq_dispatch_bank(mmio_read(IRQ_REG(BCM2835_IRQ_BASIC_PENDING)) & 0xff, 64);
+  irq_dispatch_bank(mmio_read(IRQ_REG(BCM2835_IRQ_PENDING1)), 0);
+  irq_dispatch_bank(mmio_read(IRQ_REG(BCM2835_IRQ_PENDING2)), 32);
+}
+
+void irq_exception(uint32_t type, uint32_t pc, uint32_t address, uint32_t status)
+{
+  if(type > 3)
+    type = 3;
+
+  printf("\n%s at 0x%08lx", exception_names[type], (unsigned long)pc);
+  if(type == 1 || type == 2)
+    printf(" (address 0x%08lx, status 0x%03lx)", (unsigned long)address, (unsigned long)status);
+  printf("\nSystem halted.\n");
+
+  while(1) {}
+}
@@ -0,0 +1,83 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+
+#ifndef IRQ_H
+#define IRQ_H
+
+typedef void (*irq_handler_t)(void *arg);
+
+/**
+ * irq_init - Starts interrupt handling
+ *
+ * Masks every source in the interrupt controller,
+ * then unmasks IRQs on the ARM. Sources are only
+ * enabled once a handler is registered for them.
+ */
+void irq_init();
+
+/**
+ * irq_register - Installs an interrupt handler
+ *
+ * @source: A bcm2835IRQSource number.
+ * @handler: Called in IRQ mode while the source is pending.
+ * @arg: Passed to handler.
+ *
+ * Enables the source in the interrupt controller.
+ * The handler must clear the interrupt in the
+ * peripheral. Returns 0 on success and -1 if the
+ * source is invalid or already taken.
+ */
+int irq_register(uint32_t source, irq_handler_t handler, void *arg);
+
+/**
+ * irq_unregister - Removes an interrupt handler
+ *
+ * @source: A bcm2835IRQSource number.
+ *
+ * Disables the source in the interrupt controller.
+ */
+void irq_unregister(uint32_t source);
+
+/**
+ * irq_dispatch - Runs the handlers of pending sources
+ *
+ * Called from the IRQ vector. Pending sources
+ * without a handler are disabled so they
+ * cannot keep the ARM in IRQ mode.
+ */
+void irq_dispatch();
+
+/**
+ * irq_exception - Reports a fatal exception
+ *
+ * @type: 0 undefined, 1 prefetch abort, 2 data abort.
+ * @pc: Address of the faulting instruction.
+ * @address: Faulting address for aborts.
+ * @status: Fault status register for aborts.
+ *
+ * Called from the exception vectors, never returns.
+ */
+void irq_exception(uint32_t type, uint32_t pc, uint32_t address, uint32_t status);
+
+extern void enable_irq();
+extern void disable_irq();
+extern uint32_t irq_save();
+extern void irq_restore(uint32_t cpsr);
+extern void wait_for_interrupt();
+
+#endif
@@ -0,0 +1,265 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include "ljcache.h"
+#include "ff.h"
+#include "LUA/lauxlib.h"
+#include "LUA/luajit.h"
+
+// Sources that are already bytecode start with this
+#define LJ_BC_HEAD      "\033LJ"
+
+// lua_dump output gathered in memory
+typedef struct ljcache_dump {
+  char *data;
+  size_t size;
+  size_t capacity;
+} ljcache_dump;
+
+static uint32_t ljcache_hash(const uint8_t *data, uint32_t size)
+{
+  uint32_t hash = 2166136261u;
+
+  while(size--) {
+    hash ^= *data++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int ljcache_writer(lua_State *L, const void *p, size_t size, void *ud)
+{
+  ljcache_dump *dump = (ljcache_dump *)ud;
+  (void)L;
+
+  if(dump->size + size > dump->capacity) {
+    size_t capacity = dump->capacity ? dump->capacity * 2 : 4096;
+    char *data;
+    while(capacity < dump->size + size)
+      capacity *= 2;
+    data = realloc(dump->data, capacity);
+    if(!data)
+      return 1;
+    dump->data = data;
+    dump->capacity = capacity;
+  }
+  memcpy(dump->data + dump->size, p, size);
+  dump->size += size;
+  return 0;
+}
+
+/**
+ * ljcache_read - Reads a whole file into memory
+ *
+ * @path: File to read.
+ * @size: Set to the file size.
+ *
+ * Returns a malloc'd copy or 0.
+ */
+static uint8_t *ljcache_read(const char *path, uint32_t *size)
+{
+  uint8_t *data;
+  FIL file;
+  UINT n;
+
+  if(f_open(&file, path, FA_READ) != FR_OK)
+    return 0;
+  *size = f_size(&file);
+  data = malloc(*size ? *size : 1);
+  if(data && (f_read(&file, data, *size, &n) != FR_OK || n != *size)) {
+    free(data);
+    data = 0;
+  }
+  f_close(&file);
+  return data;
+}
+
+/**
+ * ljcache_load_sidecar - Loads a sidecar that matches the source
+ *
+ * @L: Lua environment
+ * @sidecar: Path of the sidecar.
+ * @size: Size of the source.
+ * @hash: Hash of the source.
+ *
+ * Returns 0 with the chunk pushed, or -1
+ * if the sidecar is missing or stale.
+ */
+static int ljcache_load_sidecar(lua_State *L, const char *sidecar, uint32_t size, uint32_t hash)
+{
+  ljcache_header header;
+  char *dump;
+  FIL file;
+  UINT n;
+  int status = -1;
+
+  if(f_open(&file, sidecar, FA_READ) != FR_OK)
+    return -1;
+  if(f_read(&file, &header, sizeof(header), &n) == FR_OK && n == sizeof(header) &&
+     header.magic == LJCACHE_MAGIC && header.version == LUAJIT_VERSION_NUM &&
+     header.source_size == size && header.source_hash == hash &&
+     header.dump_size == f_size(&file) - sizeof(header)) {
+    dump = malloc(header.dump_size ? header.dump_size : 1);
+    if(dump) {
+      if(f_read(&file, dump, header.dump_size, &n) == FR_OK && n == header.dump_size) {
+        status = luaL_loadbuffer(L, dump, header.dump_size, sidecar);
+        if(status != 0) {
+          lua_pop(L, 1);
+          status = -1;
+        }
+      }
+      free(dump);
+    }
+  }
+  f_close(&file);
+  return status;
+}
+
+// Writes the function on top of the stack to a sidecar, failures only cost speed
+static void ljcache_store(lua_State *L, const char *sidecar, uint32_t size, uint32_t hash)
+{
+  ljcache_dump dump = { 0, 0, 0 };
+  ljcache_header header;
+  FIL file;
+  UINT n;
+
+  if(lua_dump(L, ljcache_writer, &dump) == 0 &&
+     f_open(&file, sidecar, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK) {
+    header.magic = LJCACHE_MAGIC;
+    header.version = LUAJIT_VERSION_NUM;
+    header.source_size = size;
+    header.source_hash = hash;
+    header.dump_size = dump.size;
+    if(f_write(&file, &header, sizeof(header), &n) != FR_OK || n != sizeof(header) ||
+       f_write(&file, dump.data, dump.size, &n) != FR_OK || n != dump.size) {
+      f_close(&file);
+      f_unlink(sidecar);
+    } else {
+      f_close(&file);
+    }
+  }
+  free(dump.data);
+}
+
+int ljcache_loadfile(lua_State *L, const char *path)
+{
+  uint8_t *source;
+  uint32_t size;
+  uint32_t hash;
+  int status;
+
+  source = ljcache_read(path, &size);
+  if(!source)
+    return luaL_loadfile(L, path);
+
+  lua_pushfstring(L, "@%s", path);
+  if(size >= 3 && memcmp(source, LJ_BC_HEAD, 3) == 0) {
+    status = luaL_loadbuffer(L, (char *)source, size, lua_tostring(L, -1));
+    free(source);
+    lua_remove(L, -2);
+    return status;
+  }
+
+  hash = ljcache_hash(source, size);
+  lua_pushfstring(L, "%s" LJCACHE_SUFFIX, path);
+  if(ljcache_load_sidecar(L, lua_tostring(L, -1), size, hash) == 0) {
+    free(source);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return 0;
+  }
+
+  status = luaL_loadbuffer(L, (char *)source, size, lua_tostring(L, -2));
+  free(source);
+  if(status == 0)
+    ljcache_store(L, lua_tostring(L, -2), size, hash);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return status;
+}
+
+/**
+ * ljcache_search - Finds a module along package.path
+ *
+ * @L: Lua environment
+ * @name: Module name.
+ *
+ * Pushes the file name found, or the list of
+ * files tried, and returns 1 or 0 respectively.
+ */
+static int ljcache_search(lua_State *L, const char *name)
+{
+  const char *path;
+  const char *end;
+  FILINFO info;
+
+  name = luaL_gsub(L, name, ".", LUA_DIRSEP);
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "path");
+  path = lua_tostring(L, -1);
+  if(!path)
+    luaL_error(L, "'package.path' must be a string");
+
+  lua_pushliteral(L, "");
+  for(; *path; path = *end ? end + 1 : end) {
+    const char *file;
+    end = strchr(path, *LUA_PATHSEP);
+    if(!end)
+      end = path + strlen(path);
+    if(end == path)
+      continue;
+    lua_pushlstring(L, path, end - path);
+    file = luaL_gsub(L, lua_tostring(L, -1), LUA_PATH_MARK, name);
+    lua_remove(L, -2);
+    if(f_stat(file, &info) == FR_OK && !(info.fattrib & AM_DIR)) {
+      // Keep only the file over name, package, path and message
+      lua_replace(L, -5);
+      lua_pop(L, 3);
+      return 1;
+    }
+    lua_pushfstring(L, "\n\tno file '%s'", file);
+    lua_remove(L, -2);
+    lua_concat(L, 2);
+  }
+  lua_replace(L, -4);
+  lua_pop(L, 2);
+  return 0;
+}
+
+static int ljcache_searcher(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const char *file;
+
+  if(!ljcache_search(L, name))
+    return 1;
+  file = lua_tostring(L, -1);
+  if(ljcache_loadfile(L, file) != 0)
+    return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+                      name, file, lua_tostring(L, -1));
+  return 1;
+}
+
+void ljcache_register(lua_State *L)
+{
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaders");
+  lua_pushcfunction(L, ljcache_searcher);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+}
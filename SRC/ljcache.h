@@ -0,0 +1,62 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "LUA/lua.h"
+
+#ifndef LJCACHE_H
+#define LJCACHE_H
+
+// Appended to a source path to name its bytecode sidecar
+#define LJCACHE_SUFFIX  ".ljbc"
+
+#define LJCACHE_MAGIC   0x43434a4c      // "LJCC"
+
+// Sidecar header, lua_dump output follows
+typedef struct ljcache_header {
+  uint32_t magic;
+  uint32_t version;       // LUAJIT_VERSION_NUM of the dump
+  uint32_t source_size;
+  uint32_t source_hash;   // FNV-1a of the source bytes
+  uint32_t dump_size;
+} ljcache_header;
+
+/**
+ * ljcache_loadfile - luaL_loadfile with a bytecode cache
+ *
+ * @L: Lua environment
+ * @path: Lua source file.
+ *
+ * Loads path.ljbc instead when its header matches
+ * the size and hash of the source, otherwise parses
+ * the source and writes a new sidecar. Returns what
+ * luaL_loadfile returns.
+ */
+int ljcache_loadfile(lua_State *L, const char *path);
+
+/**
+ * ljcache_register - Makes require use the bytecode cache
+ *
+ * @L: Lua environment to add to
+ *
+ * Replaces the Lua file searcher in
+ * package.loaders[2] with one that searches
+ * package.path the same way and loads through
+ * ljcache_loadfile.
+ */
+void ljcache_register(lua_State *L);
+
+#endif
@@ -15,6 +15,10 @@
 // along with this program. If not, see <https://www.gnu.org/licenses/>.
 
 #include "bcm2835.h"
+#include "timer.h"
+#include "luabuf.h"
+#include "spidma.h"
+#include "sched.h"
 #include "stdio.h"
 #include "LUA/luajit.h"
 #include "LUA/lauxlib.h"
@@ -50,13 +54,24 @@ static int l_delay (lua_State *L)
 {
   double d = luaL_checknumber(L, 1);
   if((double)(uint32_t)d == d) {
-    bcm2835_delay((uint32_t)d);  
+    timer_sleep_idle(timer_now() + (uint64_t)(uint32_t)d * 1000);
   } else {
     luaL_error(L, "BCM2835 Error: Invalid argument to delay (expected uint32_t).");
   }
   return 0;
 }
 
+static int l_delay_us (lua_State *L)
+{
+  double d = luaL_checknumber(L, 1);
+  if((double)(uint32_t)d == d) {
+    timer_sleep_idle(timer_now() + (uint32_t)d);
+  } else {
+    luaL_error(L, "BCM2835 Error: Invalid argument to delayMicroseconds (expected uint32_t).");
+  }
+  return 0;
+}
+
 static int l_fsel (lua_State *L)
 {
   double p = luaL_checknumber(L, 1);
@@ -146,6 +161,272 @@ static int l_lev (lua_State *L)
   return 1;
 }
 
+#define LUA_PIN "CirnOS.pin"
+
+// Pin handle with its registers resolved up front. For an
+// inverted pin on and off point at GPCLR and GPSET, reads
+// are not inverted.
+typedef struct {
+  volatile uint32_t *on;
+  volatile uint32_t *off;
+  volatile uint32_t *lev;
+  uint32_t mask;
+  uint8_t invert;
+  uint8_t gpio;
+} lua_pin;
+
+static int l_gpio_pin (lua_State *L)
+{
+  double p = luaL_checknumber(L, 1);
+  if((double)(uint8_t)p != p) {
+    luaL_error(L, "BCM2835 Error: Invalid argument for pin (expected uint8_t).");
+  }
+
+  uint8_t gpio_pin;
+  if (rpi_pin_to_gpio((uint8_t)p, &gpio_pin) != 0) {
+      luaL_error(L, "PIN Error: Invalid pin value.");
+  }
+
+  if(!lua_isnoneornil(L, 2)) {
+    double k = luaL_checknumber(L, 2);
+    if((double)(uint8_t)k != k || k > 8) {
+      luaL_error(L, "BCM2835 Error: Invalid mode value.");
+    }
+    bcm2835_gpio_fsel(gpio_pin, (uint8_t)k);
+  }
+
+  lua_pin *pin = (lua_pin *)lua_newuserdata(L, sizeof(lua_pin));
+  volatile uint32_t *set = bcm2835_gpio + BCM2835_GPSET0/4 + gpio_pin/32;
+  volatile uint32_t *clr = bcm2835_gpio + BCM2835_GPCLR0/4 + gpio_pin/32;
+
+  // LED on Pi Zero
+  pin->invert = RPI_ZERO && gpio_pin == 47;
+  pin->on = pin->invert ? clr : set;
+  pin->off = pin->invert ? set : clr;
+  pin->lev = bcm2835_gpio + BCM2835_GPLEV0/4 + gpio_pin/32;
+  pin->mask = 1u << (gpio_pin % 32);
+  pin->gpio = gpio_pin;
+
+  luaL_getmetatable(L, LUA_PIN);
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+static int l_pin_set (lua_State *L)
+{
+  lua_pin *pin = (lua_pin *)luaL_checkudata(L, 1, LUA_PIN);
+  *pin->on = pin->mask;
+  return 0;
+}
+
+static int l_pin_clear (lua_State *L)
+{
+  lua_pin *pin = (lua_pin *)luaL_checkudata(L, 1, LUA_PIN);
+  *pin->off = pin->mask;
+  return 0;
+}
+
+static int l_pin_write (lua_State *L)
+{
+  lua_pin *pin = (lua_pin *)luaL_checkudata(L, 1, LUA_PIN);
+  int k;
+
+  // lua_isnumber would let "1" through
+  if(lua_type(L, 2) == LUA_TNUMBER) {
+    k = lua_tonumber(L, 2) != 0;
+  } else if(lua_type(L, 2) == LUA_TBOOLEAN) {
+    k = lua_toboolean(L, 2);
+  } else {
+    return luaL_error(L, "BCM2835 Error: Invalid argument for value (expected number or boolean).");
+  }
+  *(k ? pin->on : pin->off) = pin->mask;
+  return 0;
+}
+
+// pin:read() returns the raw level, like readPin
+static int l_pin_read (lua_State *L)
+{
+  lua_pin *pin = (lua_pin *)luaL_checkudata(L, 1, LUA_PIN);
+  lua_pushboolean(L, (*pin->lev & pin->mask) != 0);
+  return 1;
+}
+
+static int l_pin_toggle (lua_State *L)
+{
+  lua_pin *pin = (lua_pin *)luaL_checkudata(L, 1, LUA_PIN);
+  int k = ((*pin->lev & pin->mask) != 0) ^ pin->invert;
+  *(k ? pin->off : pin->on) = pin->mask;
+  return 0;
+}
+
+static int l_pin_tostring (lua_State *L)
+{
+  lua_pin *pin = (lua_pin *)luaL_checkudata(L, 1, LUA_PIN);
+  lua_pushfstring(L, "pin (GPIO %d)", (int)pin->gpio);
+  return 1;
+}
+
+static const luaL_Reg pin_methods[] = {
+  {"set", l_pin_set},
+  {"clear", l_pin_clear},
+  {"write", l_pin_write},
+  {"read", l_pin_read},
+  {"toggle", l_pin_toggle},
+  {0, 0}
+};
+
+#define LUA_PIN_GROUP "CirnOS.pingroup"
+
+// Up to 32 pins of bank 0 driven as one value. Bit i of the value
+// is pin i of the table. shift is set when the pins are consecutive
+// GPIOs, so the value maps onto the bank with a single shift.
+typedef struct {
+  uint32_t mask;
+  int8_t shift;
+  uint8_t count;
+  uint8_t gpio[32];
+} lua_pin_group;
+
+static int l_gpio_group (lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = lua_objlen(L, 1);
+  if(count < 1 || count > 32) {
+    luaL_error(L, "BCM2835 Error: A pin group holds 1 to 32 pins.");
+  }
+
+  int mode = -1;
+  if(!lua_isnoneornil(L, 2)) {
+    double k = luaL_checknumber(L, 2);
+    if((double)(uint8_t)k != k || k > 8) {
+      luaL_error(L, "BCM2835 Error: Invalid mode value.");
+    }
+    mode = (int)k;
+  }
+
+  lua_pin_group *group = (lua_pin_group *)lua_newuserdata(L, sizeof(lua_pin_group));
+  group->mask = 0;
+  group->count = count;
+  group->shift = -1;
+
+  int i;
+  for(i = 0; i < count; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    double p = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    uint8_t gpio_pin;
+    if((double)(uint8_t)p != p || rpi_pin_to_gpio((uint8_t)p, &gpio_pin) != 0) {
+      luaL_error(L, "PIN Error: Invalid pin value in group.");
+    }
+    if(gpio_pin >= 32) {
+      luaL_error(L, "PIN Error: Pin groups only support GPIO 0 to 31.");
+    }
+    if(group->mask & (1u << gpio_pin)) {
+      luaL_error(L, "PIN Error: Pin listed twice in group.");
+    }
+
+    group->gpio[i] = gpio_pin;
+    group->mask |= 1u << gpio_pin;
+  }
+
+  // Only touch the pins once the whole list is known to be valid
+  if(mode >= 0) {
+    for(i = 0; i < count; i++) {
+      bcm2835_gpio_fsel(group->gpio[i], mode);
+    }
+  }
+
+  for(i = 1; i < count; i++) {
+    if(group->gpio[i] != group->gpio[0] + i) {
+      break;
+    }
+  }
+  if(i == count) {
+    group->shift = group->gpio[0];
+  }
+
+  luaL_getmetatable(L, LUA_PIN_GROUP);
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+static int l_group_write (lua_State *L)
+{
+  lua_pin_group *group = (lua_pin_group *)luaL_checkudata(L, 1, LUA_PIN_GROUP);
+  double d = luaL_checknumber(L, 2);
+  if((double)(uint32_t)d != d) {
+    luaL_error(L, "BCM2835 Error: Invalid argument for value (expected uint32_t).");
+  }
+
+  uint32_t value = (uint32_t)d;
+  uint32_t set = 0;
+
+  if(group->shift >= 0) {
+    set = (value << group->shift) & group->mask;
+  } else {
+    int i;
+    for(i = 0; i < group->count; i++) {
+      if(value & (1u << i)) {
+	set |= 1u << group->gpio[i];
+      }
+    }
+  }
+
+  bcm2835_gpio[BCM2835_GPSET0/4] = set;
+  bcm2835_gpio[BCM2835_GPCLR0/4] = group->mask & ~set;
+
+  return 0;
+}
+
+static int l_group_read (lua_State *L)
+{
+  lua_pin_group *group = (lua_pin_group *)luaL_checkudata(L, 1, LUA_PIN_GROUP);
+  uint32_t lev = bcm2835_gpio[BCM2835_GPLEV0/4];
+  uint32_t value = 0;
+
+  if(group->shift >= 0) {
+    value = (lev & group->mask) >> group->shift;
+  } else {
+    int i;
+    for(i = 0; i < group->count; i++) {
+      if(lev & (1u << group->gpio[i])) {
+	value |= 1u << i;
+      }
+    }
+  }
+
+  lua_pushnumber(L, value);
+  return 1;
+}
+
+static const luaL_Reg pin_group_methods[] = {
+  {"write", l_group_write},
+  {"read", l_group_read},
+  {0, 0}
+};
+
+static int l_gpio_write_bank (lua_State *L)
+{
+  double v = luaL_checknumber(L, 1);
+  double m = luaL_optnumber(L, 2, 0xffffffff);
+  if((double)(uint32_t)v != v || (double)(uint32_t)m != m) {
+    luaL_error(L, "BCM2835 Error: Invalid argument to writeBank (expected uint32_t).");
+  }
+
+  bcm2835_gpio_write_mask((uint32_t)v, (uint32_t)m);
+
+  return 0;
+}
+
+static int l_gpio_read_bank (lua_State *L)
+{
+  lua_pushnumber(L, bcm2835_gpio[BCM2835_GPLEV0/4]);
+  return 1;
+}
+
 static int l_pwm_init (lua_State *L)
 {
   bcm2835_gpio_fsel(18, BCM2835_GPIO_FSEL_ALT5);
@@ -296,6 +577,8 @@ static int l_spi_set_clock_divider (lua_State *L)
   return 0;
 }
 
+static void spi_check_idle (lua_State *L);
+
 static int l_spi_transfer (lua_State *L)
 {
   double d = luaL_checknumber(L, 1);
@@ -303,11 +586,189 @@ static int l_spi_transfer (lua_State *L)
     luaL_error(L, "BCM2835 Error: Invalid argument for value (expected uint8_t).");
   }
 
+  // The FIFO must not be driven under a running DMA transfer
+  spi_check_idle(L);
   bcm2835_spi_transfer((uint8_t)d);
   
   return 0;
 }
 
+// Loader for require("bcm2835"). Receives the register cdefs and
+// a table of block names to base addresses, returns FFI pointers.
+static const char bcm2835_ffi_loader[] =
+  "local cdef, bases = ...\n"
+  "local ffi = require('ffi')\n"
+  "ffi.cdef(cdef)\n"
+  "local regs = {}\n"
+  "for name, base in pairs(bases) do\n"
+  "  regs[name] = ffi.cast('struct bcm2835_' .. name .. '_regs *', base)\n"
+  "end\n"
+  "return regs\n";
+
+static int l_bcm2835_ffi (lua_State *L)
+{
+  if(luaL_loadbuffer(L, bcm2835_ffi_loader, sizeof(bcm2835_ffi_loader) - 1, "=bcm2835") != 0) {
+    lua_error(L);
+  }
+
+  lua_pushstring(L, BCM2835_REGS_CDEF);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, BCM2835_GPIO_BASE);
+  lua_setfield(L, -2, "gpio");
+  lua_pushnumber(L, BCM2835_ST_BASE);
+  lua_setfield(L, -2, "st");
+  lua_pushnumber(L, BCM2835_SPI0_BASE);
+  lua_setfield(L, -2, "spi0");
+  lua_pushnumber(L, BCM2835_GPIO_PWM);
+  lua_setfield(L, -2, "pwm");
+  lua_pushnumber(L, BCM2835_IRQ_BASE);
+  lua_setfield(L, -2, "irq");
+  lua_call(L, 2, 1);
+
+  return 1;
+}
+
+// Completion of spi.transferAsync/spi.writeAsync, and the
+// buffer kept alive while the DMA owns it
+static sched_event spi_event;
+static int spi_ref = LUA_NOREF;
+
+static void spi_signal (void *arg)
+{
+  sched_event_signal((sched_event *)arg);
+}
+
+// Drops the reference to the last async buffer once it is done
+static void spi_release (lua_State *L)
+{
+  if(!spi_dma_busy() && spi_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, spi_ref);
+    spi_ref = LUA_NOREF;
+  }
+}
+
+static void spi_check_idle (lua_State *L)
+{
+  spi_release(L);
+  if(spi_dma_busy()) {
+    luaL_error(L, "BCM2835 Error: SPI transfer already running.");
+  }
+}
+
+static int spi_start_async (lua_State *L, int receive)
+{
+  lua_buffer *buf = luabuf_check(L, 1);
+  spi_check_idle(L);
+
+  sched_event_reset(&spi_event);
+  if(buf->length == 0) {
+    sched_event_signal(&spi_event);
+    return 0;
+  }
+  if(spi_dma_start(buf->data, receive ? buf->data : 0, buf->length, spi_signal, &spi_event) != 0) {
+    luaL_error(L, "BCM2835 Error: Could not start SPI DMA.");
+  }
+
+  lua_pushvalue(L, 1);
+  spi_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+// spi.transferAsync(buffer) starts a DMA transfer that overwrites
+// the buffer with the reply, the caller goes on at once
+static int l_spi_transfer_async (lua_State *L)
+{
+  return spi_start_async(L, 1);
+}
+
+// spi.writeAsync(buffer) is the same but drops the reply
+static int l_spi_write_async (lua_State *L)
+{
+  return spi_start_async(L, 0);
+}
+
+// spi.wait() blocks until the async transfer is done,
+// letting other tasks run meanwhile
+static int l_spi_wait (lua_State *L)
+{
+  if(!spi_dma_busy()) {
+    spi_release(L);
+    return 0;
+  }
+  return sched_event_wait(L, &spi_event);
+}
+
+static int l_spi_busy (lua_State *L)
+{
+  spi_release(L);
+  lua_pushboolean(L, spi_dma_busy());
+  return 1;
+}
+
+// spi.transfer(data) sends a string or buffer in one session.
+// A buffer is overwritten with the reply and returned, a
+// string gets the reply back as a new string.
+static int l_spi_transfer_buffer (lua_State *L)
+{
+  lua_buffer *buf = luabuf_test(L, 1);
+
+  spi_check_idle(L);
+  if(buf) {
+    bcm2835_spi_transfernb((char *)buf->data, (char *)buf->data, buf->length);
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  // Allocate the reply first, an error with CS asserted would leave it so
+  char *reply = (char *)lua_newuserdata(L, len);
+
+  bcm2835_spi_begin_transfer();
+  bcm2835_spi_stream(s, reply, len);
+  bcm2835_spi_end_transfer();
+  lua_pushlstring(L, reply, len);
+
+  return 1;
+}
+
+// spi.write(...) sends strings, buffers and byte values back
+// to back with CS held, discarding the reply
+static int l_spi_write (lua_State *L)
+{
+  int n = lua_gettop(L);
+  int i;
+
+  spi_check_idle(L);
+  // Check everything first so an error cannot leave CS asserted
+  for(i = 1; i <= n; i++) {
+    if(!luabuf_test(L, i) && lua_type(L, i) != LUA_TSTRING) {
+      double d = luaL_checknumber(L, i);
+      if((double)(uint8_t)d != d) {
+	luaL_error(L, "BCM2835 Error: Invalid argument for value (expected uint8_t).");
+      }
+    }
+  }
+
+  bcm2835_spi_begin_transfer();
+  for(i = 1; i <= n; i++) {
+    lua_buffer *buf = luabuf_test(L, i);
+    if(buf) {
+      bcm2835_spi_stream((char *)buf->data, 0, buf->length);
+    } else if(lua_type(L, i) == LUA_TSTRING) {
+      size_t len;
+      const char *s = lua_tolstring(L, i, &len);
+      bcm2835_spi_stream(s, 0, len);
+    } else {
+      char c = (char)lua_tonumber(L, i);
+      bcm2835_spi_stream(&c, 0, 1);
+    }
+  }
+  bcm2835_spi_end_transfer();
+
+  return 0;
+}
+
 /**
  * luabcm_register - Adds BCM library to Lua
  *
@@ -322,6 +783,8 @@ void luabcm_register(lua_State *L)
   // Registered Functions
   lua_pushcfunction(L, l_delay);
   lua_setglobal(L, "delay");
+  lua_pushcfunction(L, l_delay_us);
+  lua_setglobal(L, "delayMicroseconds");
   lua_pushcfunction(L, l_fsel);
   lua_setglobal(L, "pinMode");
   lua_pushcfunction(L, l_write);
@@ -349,6 +812,54 @@ void luabcm_register(lua_State *L)
   lua_pushcfunction(L, l_spi_transfer);  
   lua_setglobal(L, "writeByteSPI");    
 
+  // GPIO handles
+  luaL_newmetatable(L, LUA_PIN);
+  lua_newtable(L);
+  luaL_register(L, 0, pin_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_pin_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_PIN_GROUP);
+  lua_newtable(L);
+  luaL_register(L, 0, pin_group_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lua_pushcfunction(L, l_gpio_pin);
+  lua_setfield(L, -2, "pin");
+  lua_pushcfunction(L, l_gpio_group);
+  lua_setfield(L, -2, "group");
+  lua_pushcfunction(L, l_gpio_write_bank);
+  lua_setfield(L, -2, "writeBank");
+  lua_pushcfunction(L, l_gpio_read_bank);
+  lua_setfield(L, -2, "readBank");
+  lua_setglobal(L, "gpio");
+
+  lua_newtable(L);
+  lua_pushcfunction(L, l_spi_transfer_buffer);
+  lua_setfield(L, -2, "transfer");
+  lua_pushcfunction(L, l_spi_write);
+  lua_setfield(L, -2, "write");
+  lua_pushcfunction(L, l_spi_transfer_async);
+  lua_setfield(L, -2, "transferAsync");
+  lua_pushcfunction(L, l_spi_write_async);
+  lua_setfield(L, -2, "writeAsync");
+  lua_pushcfunction(L, l_spi_wait);
+  lua_setfield(L, -2, "wait");
+  lua_pushcfunction(L, l_spi_busy);
+  lua_setfield(L, -2, "busy");
+  lua_setglobal(L, "spi");
+
+  // FFI register blocks, loaded by require("bcm2835")
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, l_bcm2835_ffi);
+  lua_setfield(L, -2, "bcm2835");
+  lua_pop(L, 2);
+
   // Global
   lua_pushboolean(L, 1);
   lua_setglobal(L, "ON");
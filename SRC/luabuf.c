@@ -0,0 +1,208 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include <string.h>
+#include "luabuf.h"
+#include "mmu.h"
+#include "LUA/lauxlib.h"
+
+#define BUFFER_ALIGN(x) (((x) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1))
+
+lua_buffer *luabuf_new(lua_State *L, uint32_t length)
+{
+  uint32_t padded;
+  lua_buffer *buf;
+
+  // The userdata size below must not wrap either
+  if(length > SIZE_MAX - sizeof(lua_buffer) - 2 * CACHE_LINE_SIZE) {
+    luaL_error(L, "Buffer Error: Size too large.");
+  }
+  padded = BUFFER_ALIGN(length);
+
+  // Room for the header, the data and realigning the data
+  buf = (lua_buffer *)lua_newuserdata(L, sizeof(lua_buffer) + padded + CACHE_LINE_SIZE);
+  buf->length = length;
+  buf->data = (uint8_t *)BUFFER_ALIGN((uint32_t)(buf + 1));
+  memset(buf->data, 0, padded);
+
+  luaL_getmetatable(L, LUA_BUFFER);
+  lua_setmetatable(L, -2);
+
+  return buf;
+}
+
+lua_buffer *luabuf_check(lua_State *L, int index)
+{
+  return (lua_buffer *)luaL_checkudata(L, index, LUA_BUFFER);
+}
+
+lua_buffer *luabuf_test(lua_State *L, int index)
+{
+  lua_buffer *buf = (lua_buffer *)lua_touserdata(L, index);
+
+  if(buf == 0 || !lua_getmetatable(L, index)) {
+    return 0;
+  }
+  luaL_getmetatable(L, LUA_BUFFER);
+  if(!lua_rawequal(L, -1, -2)) {
+    buf = 0;
+  }
+  lua_pop(L, 2);
+
+  return buf;
+}
+
+/**
+ * check_index - Validates a 1-based byte index
+ *
+ * @L: Lua environment
+ * @buf: Buffer being indexed
+ * @arg: Stack index of the argument
+ *
+ * Returns the 0-based offset.
+ */
+static uint32_t check_index(lua_State *L, lua_buffer *buf, int arg)
+{
+  double i = luaL_checknumber(L, arg);
+  if((double)(uint32_t)i != i || i < 1 || i > buf->length) {
+    luaL_error(L, "Buffer Error: Index out of range.");
+  }
+  return (uint32_t)i - 1;
+}
+
+static int l_buffer_new (lua_State *L)
+{
+  double n = luaL_checknumber(L, 1);
+  if((double)(uint32_t)n != n) {
+    luaL_error(L, "Buffer Error: Invalid argument for size (expected uint32_t).");
+  }
+
+  lua_buffer *buf = luabuf_new(L, (uint32_t)n);
+
+  if(!lua_isnoneornil(L, 2)) {
+    memset(buf->data, (int)luaL_checknumber(L, 2), buf->length);
+  }
+
+  return 1;
+}
+
+static int l_buffer_len (lua_State *L)
+{
+  lua_pushnumber(L, luabuf_check(L, 1)->length);
+  return 1;
+}
+
+static int l_buffer_get (lua_State *L)
+{
+  lua_buffer *buf = luabuf_check(L, 1);
+  lua_pushnumber(L, buf->data[check_index(L, buf, 2)]);
+  return 1;
+}
+
+static int l_buffer_set (lua_State *L)
+{
+  lua_buffer *buf = luabuf_check(L, 1);
+  uint32_t i = check_index(L, buf, 2);
+  buf->data[i] = (uint8_t)luaL_checknumber(L, 3);
+  return 0;
+}
+
+static int l_buffer_fill (lua_State *L)
+{
+  lua_buffer *buf = luabuf_check(L, 1);
+  memset(buf->data, (int)luaL_checknumber(L, 2), buf->length);
+  return 0;
+}
+
+// buf:write(offset, string) copies a string in at a 1-based offset
+static int l_buffer_write (lua_State *L)
+{
+  lua_buffer *buf = luabuf_check(L, 1);
+  uint32_t i = check_index(L, buf, 2);
+  size_t len;
+  const char *s = luaL_checklstring(L, 3, &len);
+
+  if(len > buf->length - i) {
+    luaL_error(L, "Buffer Error: String does not fit.");
+  }
+  memcpy(buf->data + i, s, len);
+
+  return 0;
+}
+
+// buf:tostring([first [, last]]) returns bytes as a string
+static int l_buffer_tostring (lua_State *L)
+{
+  lua_buffer *buf = luabuf_check(L, 1);
+  uint32_t first = 0;
+  uint32_t last = buf->length;
+
+  if(buf->length == 0) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  if(!lua_isnoneornil(L, 2)) {
+    first = check_index(L, buf, 2);
+  }
+  if(!lua_isnoneornil(L, 3)) {
+    last = check_index(L, buf, 3) + 1;
+  }
+
+  lua_pushlstring(L, (const char *)buf->data + first, last > first ? last - first : 0);
+  return 1;
+}
+
+// buf:address() for ffi.cast("uint8_t *", buf:address())
+static int l_buffer_address (lua_State *L)
+{
+  lua_pushnumber(L, (uint32_t)luabuf_check(L, 1)->data);
+  return 1;
+}
+
+static const luaL_Reg buffer_methods[] = {
+  {"get", l_buffer_get},
+  {"set", l_buffer_set},
+  {"fill", l_buffer_fill},
+  {"write", l_buffer_write},
+  {"tostring", l_buffer_tostring},
+  {"address", l_buffer_address},
+  {0, 0}
+};
+
+/**
+ * luabuf_register - Adds the buffer library to Lua
+ *
+ * @L: Lua environment to add to
+ *
+ * Registers buffer.new and the methods
+ * of the buffer userdata.
+ */
+void luabuf_register(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_BUFFER);
+  lua_newtable(L);
+  luaL_register(L, 0, buffer_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_buffer_len);
+  lua_setfield(L, -2, "__len");
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lua_pushcfunction(L, l_buffer_new);
+  lua_setfield(L, -2, "new");
+  lua_setglobal(L, "buffer");
+}
@@ -0,0 +1,45 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "LUA/luajit.h"
+
+#ifndef LUABUF_H
+#define LUABUF_H
+
+#define LUA_BUFFER "CirnOS.buffer"
+
+// Byte buffer owned by Lua. data is cache line aligned and the
+// space behind it is padded to a whole line, so buffers can be
+// handed to DMA without sharing a line with other objects.
+typedef struct {
+  uint32_t length;
+  uint8_t *data;
+} lua_buffer;
+
+// Register the buffer library to lua
+void luabuf_register(lua_State *L);
+
+// Push a new zeroed buffer of length bytes
+lua_buffer *luabuf_new(lua_State *L, uint32_t length);
+
+// Get the buffer at index, raising an error if it is not one
+lua_buffer *luabuf_check(lua_State *L, int index);
+
+// Get the buffer at index, or 0 if it is not one
+lua_buffer *luabuf_test(lua_State *L, int index);
+
+#endif
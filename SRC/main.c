@@ -18,8 +18,20 @@
 
 #include "bcm2835.h"
 #include "hdmi.h"
+#include "mmu.h"
+#include "irq.h"
+#include "timer.h"
+#include "dma.h"
 #include "ff.h"
 #include "luabcm.h"
+#include "luabuf.h"
+#include "sched.h"
+#include "diskcache.h"
+#include "rawlog.h"
+#include "afs.h"
+#include "ramdisk.h"
+#include "pak.h"
+#include "ljcache.h"
 
 #include "LUA/lua.h"
 #include "LUA/lualib.h"
@@ -31,6 +43,10 @@
 #define DEFAULT_MAIN "main.lua"
 #endif
 
+// Archive built from INITFS, see SRC/initfs.s
+extern const uint8_t initfs_start[];
+extern const uint8_t initfs_end[];
+
 
 /**
  * print_init - Prints initial messages.
@@ -242,11 +258,21 @@ int notmain()
     static int status;
   
   clear_bss();
+  mmu_init();
   
   bcm2835_init();  
+  irq_init();
+  timer_init();
+  dma_init();
   hdmi_init(SCREEN_WIDTH, SCREEN_HEIGHT, BIT_DEPTH);
-  f_mount(&SDFS, "", 0);
   print_init();   
+  // Probe the card once. Unmounted, later accesses fail at once
+  // instead of each retrying the card initialisation and its timeouts
+  if(f_mount(&SDFS, "", 1) != FR_OK) {
+    printf("No usable SD card, starting from initfs.\n");
+    f_mount(0, "", 0);
+  }
+  ramdisk_boot();
 
   // Start Lua
   lua_State *L;
@@ -266,15 +292,33 @@ int notmain()
   lua_pushcclosure(L, luaopen_debug, 0); lua_pcall(L, 0, 0, 0);
   lua_pushcclosure(L, luaopen_bit, 0); lua_pcall(L, 0, 0, 0);
   lua_pushcclosure(L, luaopen_jit, 0); lua_pcall(L, 0, 0, 0);
-  // lua_pushcclosure(L, luaopen_ffi, 0); lua_pcall(L, 0, 0, 0); // unsupported
+  lua_pushcclosure(L, luaopen_ffi, 0); lua_pcall(L, 0, 0, 0);
   
   luabcm_register(L);
+  luabuf_register(L);
+  sched_register(L);
+  diskcache_register(L);
+  rawlog_register(L);
+  afs_register(L);
+  ljcache_register(L);
+  // Searched before any archive or file on the card
+  pak_mount_memory(initfs_start, initfs_end - initfs_start, "initfs");
+  pak_register(L);
   
   
   lua_pushcclosure(L, l_print_error, 0);
   base = lua_gettop(L);
   status = 0;
-  if((status = luaL_loadfile(L, DEFAULT_MAIN)) != 0) {
+  status = ljcache_loadfile(L, DEFAULT_MAIN);
+  if(status == LUA_ERRFILE) {
+    // No script on the card, run the built in one
+    lua_pop(L, 1);
+    if((status = pak_load(L, "main")) < 0) {
+      lua_pushfstring(L, "cannot open %s", DEFAULT_MAIN);
+      status = LUA_ERRFILE;
+    }
+  }
+  if(status != 0) {
     print_error(L, SYNTAX_ERROR, 1);
     lua_pop(L, 2); // err msg, err handler
     return 0;
@@ -284,13 +328,17 @@ int notmain()
     return 0;
   }
   lua_pop(L, 1); // err handler
+
+  // Keep running tasks spawned by main.lua
+  sched_run(0);
+  sched_close();
   
   lua_close(L);
   
   
   // This should only be run on errors. Lua code should end in a loop.
   printf("Warning: Lua code should end in a loop!\n");
-  while(1) bcm2835_delay((uint32_t) 1000);
+  while(1) timer_sleep(1000000);
 
   return 0;
 }
@@ -0,0 +1,100 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "mmu.h"
+#include "bcm2835.h"
+
+// The peripherals occupy 16 MiB starting at BCM2835_PERI_BASE
+#define PERI_SIZE 0x1000000
+
+// The table walker needs the table aligned to its own size
+static uint32_t mmu_table[MMU_TABLE_ENTRIES] __attribute__((aligned(0x4000)));
+
+void mmu_init()
+{
+#ifndef NO_MMU
+  uint32_t i;
+  uint32_t address;
+
+  for(i = 0; i < MMU_TABLE_ENTRIES; i++) {
+    address = i * MMU_SECTION_SIZE;
+    if(address < BCM2835_PERI_BASE)
+      mmu_table[i] = address | MMU_NORMAL_WRITE_BACK;
+    else if(address < BCM2835_PERI_BASE + PERI_SIZE)
+      mmu_table[i] = address | MMU_DEVICE;
+    else
+      mmu_table[i] = address | MMU_STRONGLY_ORDERED;
+  }
+
+  mmu_enable(mmu_table);
+#endif
+}
+
+void mmu_set_bufferable(uint32_t address, uint32_t size)
+{
+#ifndef NO_MMU
+  uint32_t i;
+  uint32_t first = address / MMU_SECTION_SIZE;
+  uint32_t last = (address + size - 1) / MMU_SECTION_SIZE;
+
+  if(size == 0)
+    return;
+
+  for(i = first; i <= last && i < MMU_TABLE_ENTRIES; i++)
+    mmu_table[i] = (i * MMU_SECTION_SIZE) | MMU_NORMAL_UNCACHED;
+
+  // The table itself is cached, the walker is not
+  dcache_clean(&mmu_table[first], (last - first + 1) * sizeof(uint32_t));
+  mmu_invalidate_tlb();
+#endif
+}
+
+void dcache_clean(const void *address, size_t size)
+{
+  uint32_t start = (uint32_t)address;
+
+  if(size)
+    dcache_clean_range(start, start + size);
+}
+
+void dcache_invalidate(void *address, size_t size)
+{
+  uint32_t start = (uint32_t)address;
+  uint32_t end = start + size;
+
+  if(size == 0)
+    return;
+
+  if(start & (CACHE_LINE_SIZE - 1)) {
+    dcache_flush_range(start, start + 1);
+    start = (start | (CACHE_LINE_SIZE - 1)) + 1;
+  }
+  if((end & (CACHE_LINE_SIZE - 1)) && end > start) {
+    dcache_flush_range(end - 1, end);
+    end &= ~(CACHE_LINE_SIZE - 1);
+  }
+  if(end > start)
+    dcache_invalidate_range(start, end);
+}
+
+void dcache_flush(const void *address, size_t size)
+{
+  uint32_t start = (uint32_t)address;
+
+  if(size)
+    dcache_flush_range(start, start + size);
+}
@@ -0,0 +1,106 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef MMU_H
+#define MMU_H
+
+#define MMU_SECTION_SIZE        0x100000
+#define MMU_TABLE_ENTRIES       4096
+
+// ARMv6 section descriptor bits (SCTLR.XP set)
+#define MMU_SECTION             0x00002
+#define MMU_BUFFERABLE          (1 << 2)
+#define MMU_CACHEABLE           (1 << 3)
+#define MMU_EXECUTE_NEVER       (1 << 4)
+#define MMU_AP_READ_WRITE       (3 << 10)
+#define MMU_TEX(x)              ((x) << 12)
+
+// Normal memory, write-back cached
+#define MMU_NORMAL_WRITE_BACK   (MMU_SECTION | MMU_AP_READ_WRITE | MMU_CACHEABLE | MMU_BUFFERABLE)
+// Normal memory, uncached but writes may be merged
+#define MMU_NORMAL_UNCACHED     (MMU_SECTION | MMU_AP_READ_WRITE | MMU_TEX(1) | MMU_EXECUTE_NEVER)
+// Shared device memory, used for the peripherals
+#define MMU_DEVICE              (MMU_SECTION | MMU_AP_READ_WRITE | MMU_BUFFERABLE | MMU_EXECUTE_NEVER)
+// Strongly ordered, used for the GPU bus aliases
+#define MMU_STRONGLY_ORDERED    (MMU_SECTION | MMU_AP_READ_WRITE | MMU_EXECUTE_NEVER)
+
+#define CACHE_LINE_SIZE         32
+
+/**
+ * mmu_init - Enables the MMU
+ *
+ * Builds a flat translation table that caches
+ * RAM below the peripherals and leaves everything
+ * else uncached, then turns on the MMU. Does
+ * nothing when built with NO_MMU.
+ */
+void mmu_init();
+
+/**
+ * mmu_set_bufferable - Maps a region for write combining
+ *
+ * @address: Start of the region.
+ * @size: Length of the region in bytes.
+ *
+ * Marks every section touching the region as
+ * normal uncached memory. Used for the framebuffer,
+ * which the GPU reads without snooping the cache.
+ */
+void mmu_set_bufferable(uint32_t address, uint32_t size);
+
+/**
+ * dcache_clean - Writes cached data back to RAM
+ *
+ * @address: Start of the buffer.
+ * @size: Length of the buffer in bytes.
+ *
+ * Must be called before a DMA engine or the
+ * GPU reads a buffer written by the ARM.
+ */
+void dcache_clean(const void *address, size_t size);
+
+/**
+ * dcache_invalidate - Discards cached data
+ *
+ * @address: Start of the buffer.
+ * @size: Length of the buffer in bytes.
+ *
+ * Must be called after a DMA engine or the
+ * GPU wrote to a buffer the ARM will read.
+ * Partial lines at either end are written
+ * back first so neighbouring data survives.
+ */
+void dcache_invalidate(void *address, size_t size);
+
+/**
+ * dcache_flush - Writes back and discards cached data
+ *
+ * @address: Start of the buffer.
+ * @size: Length of the buffer in bytes.
+ */
+void dcache_flush(const void *address, size_t size);
+
+extern void mmu_enable(uint32_t *table);
+extern void mmu_invalidate_tlb();
+extern void dcache_clean_range(uint32_t start, uint32_t end);
+extern void dcache_invalidate_range(uint32_t start, uint32_t end);
+extern void dcache_flush_range(uint32_t start, uint32_t end);
+extern void dcache_flush_all();
+
+#endif
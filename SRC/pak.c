@@ -0,0 +1,321 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include "pak.h"
+#include "ff.h"
+#include "LUA/lauxlib.h"
+
+// A mounted archive, its index kept in memory
+typedef struct pak_archive {
+  FIL file;
+  const uint8_t *data;    // Whole image for archives in memory, else 0
+  uint32_t size;
+  pak_header header;
+  pak_entry *index;
+  char *names;
+  char *path;
+  struct pak_archive *next;
+} pak_archive;
+
+static pak_archive *archives;
+
+static void pak_append(pak_archive *pak)
+{
+  pak_archive **link;
+
+  for(link = &archives; *link; link = &(*link)->next)
+    ;
+  *link = pak;
+}
+
+static int pak_check_header(pak_header *header, uint32_t size)
+{
+  return header->magic == PAK_MAGIC &&
+    (header->version & PAK_VERSION_MASK) == PAK_VERSION &&
+    header->count <= size / sizeof(pak_entry) &&
+    header->names_size <= size;
+}
+
+int pak_mount(const char *path)
+{
+  pak_archive *pak = calloc(1, sizeof(pak_archive));
+  uint32_t index_size;
+  UINT n;
+
+  if(!pak)
+    return -1;
+  if(f_open(&pak->file, path, FA_READ) != FR_OK) {
+    free(pak);
+    return -1;
+  }
+
+  if(f_read(&pak->file, &pak->header, sizeof(pak_header), &n) != FR_OK ||
+     n != sizeof(pak_header) || !pak_check_header(&pak->header, f_size(&pak->file)))
+    goto fail;
+
+  // Index and names follow the header, one read for both
+  index_size = pak->header.count * sizeof(pak_entry);
+  pak->index = malloc(index_size + pak->header.names_size + 1);
+  pak->path = strdup(path);
+  if(!pak->index || !pak->path)
+    goto fail;
+  if(f_read(&pak->file, pak->index, index_size + pak->header.names_size, &n) != FR_OK ||
+     n != index_size + pak->header.names_size)
+    goto fail;
+  pak->names = (char *)pak->index + index_size;
+  pak->names[pak->header.names_size] = 0;
+
+  pak_append(pak);
+  return 0;
+
+fail:
+  f_close(&pak->file);
+  free(pak->index);
+  free(pak->path);
+  free(pak);
+  return -1;
+}
+
+int pak_mount_memory(const void *data, uint32_t size, const char *name)
+{
+  pak_archive *pak;
+  pak_header *header = (pak_header *)data;
+  uint32_t names_end;
+
+  if(size < sizeof(pak_header) || !pak_check_header(header, size))
+    return -1;
+  names_end = sizeof(pak_header) + header->count * sizeof(pak_entry) + header->names_size;
+  if(names_end > size)
+    return -1;
+  // The names are used in place, so the last one must be terminated
+  if(header->names_size && ((const char *)data)[names_end - 1] != 0)
+    return -1;
+
+  pak = calloc(1, sizeof(pak_archive));
+  if(!pak)
+    return -1;
+  pak->data = data;
+  pak->size = size;
+  pak->header = *header;
+  pak->index = (pak_entry *)(header + 1);
+  pak->names = (char *)(pak->index + header->count);
+  pak->path = (char *)name;
+  pak_append(pak);
+  return 0;
+}
+
+/**
+ * pak_find - Looks a module up in an archive
+ *
+ * @pak: Archive to search.
+ * @name: Module name.
+ *
+ * Binary search on the hash, then the names
+ * of entries sharing it are compared.
+ */
+static pak_entry *pak_find(pak_archive *pak, const char *name)
+{
+  uint32_t hash = pak_hash(name);
+  uint32_t lo = 0;
+  uint32_t hi = pak->header.count;
+
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(pak->index[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for(; lo < pak->header.count && pak->index[lo].hash == hash; lo++) {
+    pak_entry *e = &pak->index[lo];
+    if(e->name < pak->header.names_size && strcmp(pak->names + e->name, name) == 0)
+      return e;
+  }
+  return 0;
+}
+
+/**
+ * pak_data - Gets the contents of a module
+ *
+ * @pak: Archive holding it.
+ * @e: Its entry.
+ * @size: Set to the size of the contents.
+ * @owned: Set to memory the caller frees, may be 0.
+ *
+ * Archives in memory are used in place unless
+ * compressed. Returns 0 on read or format errors.
+ */
+static const char *pak_data(pak_archive *pak, pak_entry *e, uint32_t *size, void **owned)
+{
+  const uint8_t *src;
+  uint8_t *raw = 0;
+  uint8_t *out;
+  uint32_t raw_size = 0;
+  UINT n;
+
+  *owned = 0;
+  if(pak->data) {
+    if(e->offset > pak->size || e->size > pak->size - e->offset)
+      return 0;
+    src = pak->data + e->offset;
+  } else {
+    raw = malloc(e->size ? e->size : 1);
+    if(!raw)
+      return 0;
+    if(f_lseek(&pak->file, e->offset) != FR_OK ||
+       f_read(&pak->file, raw, e->size, &n) != FR_OK || n != e->size) {
+      free(raw);
+      return 0;
+    }
+    src = raw;
+  }
+
+  if(!(pak->header.version & PAK_FLAG_LZ)) {
+    *owned = raw;
+    *size = e->size;
+    return (const char *)src;
+  }
+
+  out = 0;
+  if(e->size >= 4) {
+    raw_size = src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+    out = malloc(raw_size ? raw_size : 1);
+    if(out && pak_unlz(src + 4, e->size - 4, out, raw_size) < 0) {
+      free(out);
+      out = 0;
+    }
+  }
+  free(raw);
+  *owned = out;
+  *size = raw_size;
+  return (const char *)out;
+}
+
+/**
+ * pak_load_entry - Loads one module of an archive
+ *
+ * @L: Lua environment
+ * @pak: Archive holding it.
+ * @e: Its entry.
+ * @name: Module name, for the chunk name.
+ *
+ * Pushes the chunk or a message, returns
+ * what luaL_loadbuffer returns.
+ */
+static int pak_load_entry(lua_State *L, pak_archive *pak, pak_entry *e, const char *name)
+{
+  const char *data;
+  uint32_t size;
+  void *owned;
+  int status;
+
+  data = pak_data(pak, e, &size, &owned);
+  if(!data) {
+    lua_pushliteral(L, "read failed");
+    return LUA_ERRFILE;
+  }
+  lua_pushfstring(L, "@%s/%s", pak->path, name);
+  status = luaL_loadbuffer(L, data, size, lua_tostring(L, -1));
+  lua_remove(L, -2);
+  free(owned);
+  return status;
+}
+
+int pak_load(lua_State *L, const char *name)
+{
+  pak_archive *pak;
+
+  for(pak = archives; pak; pak = pak->next) {
+    pak_entry *e = pak_find(pak, name);
+    if(e)
+      return pak_load_entry(L, pak, e, name);
+  }
+  return -1;
+}
+
+/**
+ * pak_searcher - package.loaders entry for archives
+ *
+ * @L: Lua environment
+ *
+ * Returns the loaded chunk of the first archive
+ * holding the module, or a message listing the
+ * archives searched, as the other loaders do.
+ */
+static int pak_searcher(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  pak_archive *pak;
+  luaL_Buffer msg;
+
+  for(pak = archives; pak; pak = pak->next) {
+    pak_entry *e = pak_find(pak, name);
+    if(!e)
+      continue;
+    if(pak_load_entry(L, pak, e, name) != 0)
+      return luaL_error(L, "error loading module '%s' from archive '%s':\n\t%s",
+                        name, pak->path, lua_tostring(L, -1));
+    return 1;
+  }
+
+  luaL_buffinit(L, &msg);
+  for(pak = archives; pak; pak = pak->next) {
+    lua_pushfstring(L, "\n\tno module '%s' in archive '%s'", name, pak->path);
+    luaL_addvalue(&msg);
+  }
+  luaL_pushresult(&msg);
+  return 1;
+}
+
+// pak.mount(path) returns true, or nil and a message
+static int l_pak_mount(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+
+  if(pak_mount(path) < 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "Pak Error: Could not mount '%s'.", path);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+void pak_register(lua_State *L)
+{
+  int i;
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaders");
+  // Shift every loader after package.preload up by one
+  for(i = lua_objlen(L, -1); i >= 2; i--) {
+    lua_rawgeti(L, -1, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushcfunction(L, pak_searcher);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+
+  lua_newtable(L);
+  lua_pushcfunction(L, l_pak_mount);
+  lua_setfield(L, -2, "mount");
+  lua_setglobal(L, "pak");
+
+  pak_mount(PAK_DEFAULT);
+}
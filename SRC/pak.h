@@ -0,0 +1,165 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+
+#ifndef PAK_H
+#define PAK_H
+
+// Module archive layout, shared with the host packer in TOOLS/pak.c.
+// All fields are little endian. The file holds a header, the index
+// sorted by hash, the NUL terminated names and then the module data,
+// each module in one piece.
+
+#define PAK_MAGIC       0x4b41504c      // "LPAK"
+#define PAK_VERSION     1
+
+// header.version holds the version in its low bits and flags above.
+// With PAK_FLAG_LZ every module is compressed, its data then starts
+// with the uncompressed size followed by pak_unlz tokens.
+#define PAK_VERSION_MASK        0xffff
+#define PAK_FLAG_LZ             0x10000
+
+// LZ tokens: 0x00-0x7f are followed by that many literals plus one,
+// 0x80-0xff copy (token & 0x7f) + 3 bytes from a 16 bit offset back
+#define PAK_LZ_MIN_MATCH        3
+#define PAK_LZ_MAX_MATCH        (0x7f + PAK_LZ_MIN_MATCH)
+#define PAK_LZ_MAX_LITERALS     0x80
+#define PAK_LZ_WINDOW           0xffff
+
+// Archive mounted at boot if it exists
+#define PAK_DEFAULT     "modules.pak"
+
+typedef struct pak_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;         // Entries in the index
+  uint32_t names_size;    // Bytes of names after the index
+} pak_header;
+
+typedef struct pak_entry {
+  uint32_t hash;          // pak_hash of the module name
+  uint32_t name;          // Offset of the name in the name table
+  uint32_t offset;        // Offset of the data in the file
+  uint32_t size;          // Bytes of Lua source or bytecode
+} pak_entry;
+
+/**
+ * pak_hash - FNV-1a hash of a module name
+ *
+ * @name: Name as passed to require, e.g. "gfx.sprite".
+ */
+static inline uint32_t pak_hash(const char *name)
+{
+  uint32_t hash = 2166136261u;
+
+  while(*name) {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * pak_unlz - Expands an LZ compressed module
+ *
+ * @src: Tokens.
+ * @size: Bytes of tokens.
+ * @dst: Memory for the result.
+ * @dst_size: Exact size of the result.
+ *
+ * Returns 0 on success and -1 on corrupt input.
+ */
+static inline int pak_unlz(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t dst_size)
+{
+  const uint8_t *end = src + size;
+  uint32_t out = 0;
+
+  while(src < end) {
+    uint32_t token = *src++;
+    if(token < 0x80) {
+      uint32_t n = token + 1;
+      if(n > (uint32_t)(end - src) || n > dst_size - out)
+        return -1;
+      while(n--)
+        dst[out++] = *src++;
+    } else {
+      uint32_t n = (token & 0x7f) + PAK_LZ_MIN_MATCH;
+      uint32_t offset;
+      if(end - src < 2)
+        return -1;
+      offset = src[0] | (src[1] << 8);
+      src += 2;
+      if(offset == 0 || offset > out || n > dst_size - out)
+        return -1;
+      while(n--) {
+        dst[out] = dst[out - offset];
+        out++;
+      }
+    }
+  }
+  return out == dst_size ? 0 : -1;
+}
+
+#ifndef PAK_HOST
+#include "LUA/lua.h"
+
+/**
+ * pak_mount - Adds an archive to the module searcher
+ *
+ * @path: Archive to read the index of.
+ *
+ * Archives mounted later are searched later.
+ * Returns 0 on success and -1 if the file is
+ * missing or not an archive.
+ */
+int pak_mount(const char *path);
+
+/**
+ * pak_mount_memory - Adds an archive already in memory
+ *
+ * @data: Archive image, word aligned, kept in place.
+ * @size: Bytes of the image.
+ * @name: Name used in chunk names and messages.
+ *
+ * Returns 0 on success and -1 if it is not an archive.
+ */
+int pak_mount_memory(const void *data, uint32_t size, const char *name);
+
+/**
+ * pak_load - Loads a module from the mounted archives
+ *
+ * @L: Lua environment
+ * @name: Module name.
+ *
+ * Returns -1 with nothing pushed if no archive has
+ * the module, otherwise what luaL_loadbuffer returns.
+ */
+int pak_load(lua_State *L, const char *name);
+
+/**
+ * pak_register - Adds the archive searcher to Lua
+ *
+ * @L: Lua environment to add to
+ *
+ * Puts the searcher right after package.preload,
+ * so archived modules win over loose files, mounts
+ * PAK_DEFAULT if present and registers pak.mount.
+ */
+void pak_register(lua_State *L);
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "ramdisk.h"
+#include "mmu.h"
+
+#define SECTOR_SIZE             512
+
+// Longest path handled while seeding
+#define RAMDISK_PATH_MAX        256
+
+// Bytes moved per read while seeding
+#define RAMDISK_COPY_SIZE       16384
+
+// Deepest directory nesting copied while seeding
+#define RAMDISK_DEPTH_MAX       16
+
+static FATFS ramfs;
+static uint8_t *ram;
+static uint32_t ram_sectors;
+
+uint32_t ramdisk_sectors()
+{
+  return ram_sectors;
+}
+
+int ramdisk_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+  if(sector >= ram_sectors || count > ram_sectors - sector)
+    return -1;
+  memcpy(buf, ram + sector * SECTOR_SIZE, count * SECTOR_SIZE);
+  return count;
+}
+
+int ramdisk_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+  if(sector >= ram_sectors || count > ram_sectors - sector)
+    return -1;
+  memcpy(ram + sector * SECTOR_SIZE, buf, count * SECTOR_SIZE);
+  return count;
+}
+
+FRESULT ramdisk_create(uint32_t sectors)
+{
+  uint8_t *work;
+  FRESULT res;
+
+  if(ram) {
+    f_mount(0, "RAM:", 0);
+    free(ram);
+    ram = 0;
+    ram_sectors = 0;
+  }
+
+  ram = memalign(CACHE_LINE_SIZE, sectors * SECTOR_SIZE);
+  work = malloc(FF_MAX_SS);
+  if(!ram || !work) {
+    free(ram);
+    free(work);
+    ram = 0;
+    return FR_NOT_ENOUGH_CORE;
+  }
+  ram_sectors = sectors;
+
+  // One FAT and no partition table, the disk never leaves RAM
+  res = f_mkfs("RAM:", FM_FAT | FM_SFD, 0, work, FF_MAX_SS);
+  free(work);
+  if(res == FR_OK)
+    res = f_mount(&ramfs, "RAM:", 1);
+  if(res != FR_OK) {
+    free(ram);
+    ram = 0;
+    ram_sectors = 0;
+  }
+  return res;
+}
+
+// Everything seeding needs, kept off the small SVC stack
+typedef struct ramdisk_copy {
+  FIL in;
+  FIL out;
+  FILINFO info;
+  char src[RAMDISK_PATH_MAX];
+  char dst[RAMDISK_PATH_MAX];
+  uint8_t buf[RAMDISK_COPY_SIZE];
+} ramdisk_copy;
+
+static FRESULT ramdisk_copy_file(ramdisk_copy *copy)
+{
+  FRESULT res;
+  UINT got;
+  UINT put;
+
+  res = f_open(&copy->in, copy->src, FA_READ);
+  if(res != FR_OK)
+    return res;
+  res = f_open(&copy->out, copy->dst, FA_WRITE | FA_CREATE_ALWAYS);
+  if(res != FR_OK) {
+    f_close(&copy->in);
+    return res;
+  }
+
+  do {
+    res = f_read(&copy->in, copy->buf, RAMDISK_COPY_SIZE, &got);
+    if(res == FR_OK && got)
+      res = f_write(&copy->out, copy->buf, got, &put);
+    if(res == FR_OK && got && put != got)
+      res = FR_DENIED;
+  } while(res == FR_OK && got == RAMDISK_COPY_SIZE);
+
+  f_close(&copy->in);
+  if(f_close(&copy->out) != FR_OK && res == FR_OK)
+    res = FR_DISK_ERR;
+  return res;
+}
+
+/**
+ * ramdisk_copy_dir - Copies a directory recursively
+ *
+ * @copy: Paths, extended in place while descending,
+ *        and the state shared by every level.
+ * @depth: Levels left before giving up.
+ *
+ * Each level only keeps its DIR, on the heap.
+ */
+static FRESULT ramdisk_copy_dir(ramdisk_copy *copy, int depth)
+{
+  size_t src_len = strlen(copy->src);
+  size_t dst_len = strlen(copy->dst);
+  FRESULT res;
+  DIR *dir;
+
+  if(depth == 0)
+    return FR_INVALID_NAME;
+  dir = malloc(sizeof(DIR));
+  if(!dir)
+    return FR_NOT_ENOUGH_CORE;
+  res = f_opendir(dir, copy->src);
+  if(res != FR_OK) {
+    free(dir);
+    return res;
+  }
+
+  while((res = f_readdir(dir, &copy->info)) == FR_OK && copy->info.fname[0]) {
+    size_t len = strlen(copy->info.fname);
+    if(src_len + len + 2 > RAMDISK_PATH_MAX || dst_len + len + 2 > RAMDISK_PATH_MAX) {
+      res = FR_INVALID_NAME;
+      break;
+    }
+    copy->src[src_len] = '/';
+    strcpy(copy->src + src_len + 1, copy->info.fname);
+    copy->dst[dst_len] = '/';
+    strcpy(copy->dst + dst_len + 1, copy->info.fname);
+
+    // info is reused by the level below, so test it first
+    if(copy->info.fattrib & AM_DIR) {
+      res = f_mkdir(copy->dst);
+      if(res == FR_OK)
+        res = ramdisk_copy_dir(copy, depth - 1);
+    } else {
+      res = ramdisk_copy_file(copy);
+    }
+
+    copy->src[src_len] = 0;
+    copy->dst[dst_len] = 0;
+    if(res != FR_OK)
+      break;
+  }
+
+  f_closedir(dir);
+  free(dir);
+  return res;
+}
+
+FRESULT ramdisk_seed(const char *dir)
+{
+  ramdisk_copy *copy;
+  FRESULT res;
+
+  if(strlen(dir) >= RAMDISK_PATH_MAX)
+    return FR_INVALID_NAME;
+  copy = malloc(sizeof(ramdisk_copy));
+  if(!copy)
+    return FR_NOT_ENOUGH_CORE;
+
+  strcpy(copy->src, dir);
+  strcpy(copy->dst, "RAM:");
+  res = ramdisk_copy_dir(copy, RAMDISK_DEPTH_MAX);
+  free(copy);
+  return res;
+}
+
+void ramdisk_boot()
+{
+  FRESULT res;
+
+  if(RAMDISK_SECTORS == 0)
+    return;
+
+  res = ramdisk_create(RAMDISK_SECTORS);
+  if(res != FR_OK) {
+    printf("RAM disk: could not create (error %d)\n", (int)res);
+    return;
+  }
+
+  // A missing seed directory or card just leaves the disk empty
+  res = ramdisk_seed(RAMDISK_SEED);
+  if(res != FR_OK && res != FR_NO_PATH && res != FR_NOT_ENABLED)
+    printf("RAM disk: could not copy %s (error %d)\n", RAMDISK_SEED, (int)res);
+}
@@ -0,0 +1,93 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "ff.h"
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+// FatFs drive of the RAM disk, also reachable as "RAM:"
+#define RAMDISK_DRIVE           1
+
+// Sectors set aside at boot, 4 MiB by default, 0 for no RAM disk
+#ifndef RAMDISK_SECTORS
+#define RAMDISK_SECTORS         8192
+#endif
+
+// Directory on the SD card copied onto the RAM disk at boot
+#define RAMDISK_SEED            "SD:/ramdisk"
+
+/**
+ * ramdisk_create - Formats and mounts a RAM disk
+ *
+ * @sectors: Size in 512 byte sectors.
+ *
+ * Takes the memory from the heap. An existing
+ * RAM disk is unmounted and freed first.
+ * Returns FR_OK or a FatFs error.
+ */
+FRESULT ramdisk_create(uint32_t sectors);
+
+/**
+ * ramdisk_seed - Copies a directory tree onto the RAM disk
+ *
+ * @dir: Directory to copy, usually on the SD card.
+ *
+ * Its contents end up in the root of the RAM disk.
+ * Returns FR_OK, FR_NO_PATH if dir is not a
+ * directory, or another FatFs error.
+ */
+FRESULT ramdisk_seed(const char *dir);
+
+/**
+ * ramdisk_boot - Sets up the RAM disk at boot
+ *
+ * Creates a RAM disk of RAMDISK_SECTORS and
+ * fills it from RAMDISK_SEED if that exists.
+ */
+void ramdisk_boot();
+
+/**
+ * ramdisk_sectors - Returns the size of the RAM disk
+ *
+ * 0 while there is none.
+ */
+uint32_t ramdisk_sectors();
+
+/**
+ * ramdisk_read - Reads sectors of the RAM disk
+ *
+ * @buf: Memory to read to.
+ * @sector: First sector.
+ * @count: Number of sectors.
+ *
+ * Returns count or -1 past the end.
+ */
+int ramdisk_read(uint8_t *buf, uint32_t sector, uint32_t count);
+
+/**
+ * ramdisk_write - Writes sectors of the RAM disk
+ *
+ * @buf: Memory to copy from.
+ * @sector: First sector.
+ * @count: Number of sectors.
+ *
+ * Returns count or -1 past the end.
+ */
+int ramdisk_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+
+#endif
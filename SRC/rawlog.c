@@ -0,0 +1,332 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "rawlog.h"
+#include "diskio.h"
+#include "emmc.h"
+#include "diskcache.h"
+#include "luabuf.h"
+#include "mmu.h"
+#include "LUA/lauxlib.h"
+
+#define SECTOR_SIZE     512
+
+// Logs update FIL and FATFS fields that are private to ff.c, namely
+// obj.objsize, obj.sclust, fptr, clust, flag and FA_MODIFIED (shared
+// through diskio.h). Check them again before moving to another FatFs.
+#if FF_DEFINED != 63463
+#error "rawlog.c relies on FatFs R0.13 internals"
+#endif
+
+/**
+ * rawlog_store_size - Writes the log size to the directory
+ *
+ * @log: Log to update.
+ * @size: Bytes logged and on the card.
+ *
+ * The chain stays fully reserved, only the
+ * size in the directory entry moves.
+ */
+static FRESULT rawlog_store_size(rawlog *log, uint32_t size)
+{
+  FRESULT res;
+
+  // FatFs internals: FA_MODIFIED makes f_sync rewrite the directory entry
+  log->file.obj.objsize = size;
+  log->file.flag |= FA_MODIFIED;
+  res = f_sync(&log->file);
+  if(res == FR_OK)
+    log->checkpoint = size;
+  return res;
+}
+
+/**
+ * rawlog_write_buffer - Writes the buffer at the end of the log
+ *
+ * @log: Log to write.
+ *
+ * A partial last sector is padded with zeros
+ * and kept at the start of the buffer, to be
+ * written again once it fills up.
+ */
+static FRESULT rawlog_write_buffer(rawlog *log)
+{
+  uint32_t sectors = (log->fill + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  uint32_t lba = log->lba + log->flushed / SECTOR_SIZE;
+  uint32_t whole = log->fill & ~(SECTOR_SIZE - 1);
+
+  if(sectors == 0)
+    return FR_OK;
+  if(whole < log->fill)
+    memset(log->buffer + log->fill, 0, sectors * SECTOR_SIZE - log->fill);
+
+  // The sector cache must not hold older copies of these
+  diskcache_discard(lba, sectors);
+  if(sd_write(log->buffer, lba, sectors) < 0)
+    return FR_DISK_ERR;
+
+  log->flushed += whole;
+  log->fill -= whole;
+  if(log->fill)
+    memmove(log->buffer, log->buffer + whole, log->fill);
+  return FR_OK;
+}
+
+FRESULT rawlog_open(rawlog *log, const char *path, uint32_t size)
+{
+  FATFS *fs;
+  FRESULT res;
+
+  memset(log, 0, sizeof(rawlog));
+  log->buffer = memalign(CACHE_LINE_SIZE, RAWLOG_BUFFER_SIZE);
+  if(!log->buffer)
+    return FR_NOT_ENOUGH_CORE;
+
+  res = f_open(&log->file, path, FA_WRITE | FA_CREATE_ALWAYS);
+  if(res != FR_OK) {
+    free(log->buffer);
+    return res;
+  }
+
+  // Sectors are addressed on the card directly
+  fs = log->file.obj.fs;
+  if(fs->pdrv != 0)
+    res = FR_INVALID_DRIVE;
+  else
+    res = f_expand(&log->file, size, 1);
+  if(res == FR_OK) {
+    log->lba = fs->database + (log->file.obj.sclust - 2) * fs->csize;
+    log->reserved = size;
+    log->interval = RAWLOG_CHECKPOINT;
+    log->open = 1;
+    // A crash before the first checkpoint leaves an empty file
+    res = rawlog_store_size(log, 0);
+  }
+
+  if(res != FR_OK) {
+    log->open = 0;
+    f_close(&log->file);
+    f_unlink(path);
+    free(log->buffer);
+  }
+  return res;
+}
+
+FRESULT rawlog_write(rawlog *log, const void *data, uint32_t len)
+{
+  const uint8_t *src = data;
+  FRESULT res;
+
+  if(len > log->reserved - log->flushed - log->fill)
+    return FR_DENIED;
+
+  while(len) {
+    uint32_t n = RAWLOG_BUFFER_SIZE - log->fill;
+    if(n > len)
+      n = len;
+    memcpy(log->buffer + log->fill, src, n);
+    log->fill += n;
+    src += n;
+    len -= n;
+
+    if(log->fill == RAWLOG_BUFFER_SIZE) {
+      res = rawlog_write_buffer(log);
+      if(res != FR_OK)
+        return res;
+    }
+  }
+
+  if(log->flushed - log->checkpoint >= log->interval)
+    return rawlog_store_size(log, log->flushed);
+  return FR_OK;
+}
+
+FRESULT rawlog_sync(rawlog *log)
+{
+  FRESULT res = rawlog_write_buffer(log);
+
+  if(res != FR_OK)
+    return res;
+  return rawlog_store_size(log, log->flushed + log->fill);
+}
+
+FRESULT rawlog_close(rawlog *log)
+{
+  uint32_t size = log->flushed + log->fill;
+  uint32_t cluster = log->file.obj.fs->csize * SECTOR_SIZE;
+  FRESULT res = rawlog_sync(log);
+
+  if(res == FR_OK) {
+    // Cut the chain after the last used cluster. FatFs internals:
+    // f_truncate cuts at fptr and the cluster in clust
+    log->file.obj.objsize = log->reserved;
+    log->file.fptr = size;
+    if(size)
+      log->file.clust = log->file.obj.sclust + (size - 1) / cluster;
+    res = f_truncate(&log->file);
+  }
+  if(f_close(&log->file) != FR_OK && res == FR_OK)
+    res = FR_DISK_ERR;
+
+  free(log->buffer);
+  log->buffer = 0;
+  log->open = 0;
+  return res;
+}
+
+static rawlog *check_log(lua_State *L)
+{
+  rawlog *log = (rawlog *)luaL_checkudata(L, 1, LUA_RAWLOG);
+
+  if(!log->open)
+    luaL_error(L, "Log Error: Log is closed.");
+  return log;
+}
+
+static int log_error(lua_State *L, FRESULT res)
+{
+  switch(res) {
+  case FR_DENIED:
+    return luaL_error(L, "Log Error: Not enough space.");
+  case FR_INVALID_DRIVE:
+    return luaL_error(L, "Log Error: Logs only work on the SD card.");
+  case FR_NOT_ENOUGH_CORE:
+    return luaL_error(L, "Log Error: Out of memory.");
+  default:
+    return luaL_error(L, "Log Error: File system error %d.", (int)res);
+  }
+}
+
+/**
+ * l_rawlog_open - Lua wrapper for rawlog_open
+ *
+ * @L: Lua environment
+ *
+ * rawlog.open(path, megabytes [, checkpointKB])
+ * reserves the file and returns the log.
+ */
+static int l_rawlog_open(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  double mb = luaL_checknumber(L, 2);
+  double kb = luaL_optnumber(L, 3, RAWLOG_CHECKPOINT / 1024);
+  rawlog *log;
+  FRESULT res;
+
+  if(mb <= 0 || mb >= 4096)
+    return luaL_error(L, "Log Error: Invalid argument to rawlog.open (expected 0 < megabytes < 4096).");
+  if(kb < 1 || kb >= 4194304)
+    return luaL_error(L, "Log Error: Invalid argument to rawlog.open (expected checkpointKB >= 1).");
+
+  log = (rawlog *)lua_newuserdata(L, sizeof(rawlog));
+  log->open = 0;
+  luaL_getmetatable(L, LUA_RAWLOG);
+  lua_setmetatable(L, -2);
+
+  res = rawlog_open(log, path, (uint32_t)(mb * 1024 * 1024));
+  if(res != FR_OK)
+    return log_error(L, res);
+  log->interval = (uint32_t)kb * 1024;
+  return 1;
+}
+
+// log:write(data, ...) appends strings or buffers
+static int l_rawlog_write(lua_State *L)
+{
+  rawlog *log = check_log(L);
+  int n = lua_gettop(L);
+  int i;
+
+  for(i = 2; i <= n; i++) {
+    lua_buffer *buf = luabuf_test(L, i);
+    FRESULT res;
+    if(buf) {
+      res = rawlog_write(log, buf->data, buf->length);
+    } else {
+      size_t len;
+      const char *str = luaL_checklstring(L, i, &len);
+      res = rawlog_write(log, str, len);
+    }
+    if(res != FR_OK)
+      return log_error(L, res);
+  }
+  return 0;
+}
+
+static int l_rawlog_sync(lua_State *L)
+{
+  FRESULT res = rawlog_sync(check_log(L));
+
+  if(res != FR_OK)
+    return log_error(L, res);
+  return 0;
+}
+
+static int l_rawlog_close(lua_State *L)
+{
+  FRESULT res = rawlog_close(check_log(L));
+
+  if(res != FR_OK)
+    return log_error(L, res);
+  return 0;
+}
+
+// log:size() returns the bytes logged and the bytes still free
+static int l_rawlog_size(lua_State *L)
+{
+  rawlog *log = check_log(L);
+  uint32_t size = log->flushed + log->fill;
+
+  lua_pushnumber(L, size);
+  lua_pushnumber(L, log->reserved - size);
+  return 2;
+}
+
+static int l_rawlog_gc(lua_State *L)
+{
+  rawlog *log = (rawlog *)luaL_checkudata(L, 1, LUA_RAWLOG);
+
+  if(log->open)
+    rawlog_close(log);
+  return 0;
+}
+
+static const luaL_Reg rawlog_methods[] = {
+  {"write", l_rawlog_write},
+  {"sync", l_rawlog_sync},
+  {"close", l_rawlog_close},
+  {"size", l_rawlog_size},
+  {NULL, NULL}
+};
+
+void rawlog_register(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_RAWLOG);
+  lua_newtable(L);
+  luaL_register(L, 0, rawlog_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_rawlog_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lua_pushcfunction(L, l_rawlog_open);
+  lua_setfield(L, -2, "open");
+  lua_setglobal(L, "rawlog");
+}
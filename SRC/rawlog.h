@@ -0,0 +1,103 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "ff.h"
+#include "LUA/lua.h"
+
+#ifndef RAWLOG_H
+#define RAWLOG_H
+
+#define LUA_RAWLOG "CirnOS.rawlog"
+
+// Records are gathered into one multi-block write of this many sectors
+#define RAWLOG_BUFFER_SECTORS   64
+#define RAWLOG_BUFFER_SIZE      (RAWLOG_BUFFER_SECTORS * 512)
+
+// Default bytes logged between size updates in the directory
+#define RAWLOG_CHECKPOINT       (1024 * 1024)
+
+// A log file reserved as one contiguous run of sectors
+typedef struct rawlog {
+  FIL file;
+  uint32_t lba;           // First sector of the file
+  uint32_t reserved;      // Bytes allocated
+  uint32_t flushed;       // Bytes on the card in whole sectors
+  uint32_t fill;          // Bytes waiting in buffer
+  uint32_t checkpoint;    // Size last stored in the directory
+  uint32_t interval;      // Bytes between checkpoints
+  uint8_t *buffer;
+  int open;
+} rawlog;
+
+/**
+ * rawlog_open - Creates a log file and reserves its space
+ *
+ * @log: Log to set up.
+ * @path: File to create, replacing any old one.
+ * @size: Bytes to reserve.
+ *
+ * Only works on the SD card. Returns FR_OK,
+ * FR_DENIED if no contiguous space is free,
+ * or another FatFs error.
+ */
+FRESULT rawlog_open(rawlog *log, const char *path, uint32_t size);
+
+/**
+ * rawlog_write - Appends bytes to a log
+ *
+ * @log: Log from rawlog_open.
+ * @data: Bytes to append.
+ * @len: Number of bytes.
+ *
+ * Writes whole buffers straight to the card
+ * and checkpoints the size every interval.
+ * Returns FR_OK, FR_DENIED when the reserved
+ * space is full, or FR_DISK_ERR.
+ */
+FRESULT rawlog_write(rawlog *log, const void *data, uint32_t len);
+
+/**
+ * rawlog_sync - Makes everything logged so far durable
+ *
+ * @log: Log from rawlog_open.
+ *
+ * Writes the buffered tail and stores the
+ * current size in the directory.
+ */
+FRESULT rawlog_sync(rawlog *log);
+
+/**
+ * rawlog_close - Finishes a log
+ *
+ * @log: Log from rawlog_open.
+ *
+ * Syncs, then gives the unused reserved
+ * clusters back to the file system.
+ */
+FRESULT rawlog_close(rawlog *log);
+
+/**
+ * rawlog_register - Adds the log library to Lua
+ *
+ * @L: Lua environment to add to
+ *
+ * Registers rawlog.open and the methods
+ * of the log userdata.
+ */
+void rawlog_register(lua_State *L);
+
+#endif
@@ -0,0 +1,635 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "sched.h"
+#include "timer.h"
+#include "irq.h"
+
+#include "LUA/lauxlib.h"
+
+// Wheel levels: 256 slots of one tick, then three
+// levels of 64 slots covering 2^14, 2^20 and 2^26 ticks
+#define WHEEL0_BITS             8
+#define WHEELN_BITS             6
+#define WHEEL0_SIZE             (1 << WHEEL0_BITS)
+#define WHEELN_SIZE             (1 << WHEELN_BITS)
+#define WHEELN_LEVELS           3
+#define WHEEL_RANGE             (1ULL << (WHEEL0_BITS + WHEELN_LEVELS * WHEELN_BITS))
+
+#define WHEEL_SHIFT(level)      (WHEEL0_BITS + ((level) - 1) * WHEELN_BITS)
+
+// Idle GC defaults: keep 100us spare before a deadline, collect 4KB per step
+#define GC_DEFAULT_MARGIN       100
+#define GC_DEFAULT_STEP         4
+// Assumed cost of a step until one has been measured
+#define GC_INITIAL_COST         200
+
+// Longest stretch of idle work while a waited-for event may fire
+#define EVENT_IDLE_SLICE        1000
+
+struct sched_task {
+  struct sched_task *next;
+  uint64_t deadline;  // Microseconds, resume at or after this
+  uint64_t expires;   // Wheel tick holding the task
+  lua_State *co;      // Coroutine running the task
+  int ref;            // Registry reference keeping co alive
+  int nargs;          // Arguments waiting for the next resume
+  sched_event *event; // Event the task is blocked on
+};
+
+static lua_State *sched_L;
+static struct sched_task *sched_current;
+
+static struct sched_task *wheel0[WHEEL0_SIZE];
+static struct sched_task *wheeln[WHEELN_LEVELS][WHEELN_SIZE];
+// Next tick to expire, all earlier ticks are empty
+static uint64_t wheel_tick;
+static int wheel_count;
+
+// Due tasks, sorted by deadline
+static struct sched_task *ready_head;
+static int task_count;
+
+// Tasks blocked in sched_event_wait
+static struct sched_task *event_waiters;
+
+static int gc_enabled = 1;
+static uint32_t gc_margin = GC_DEFAULT_MARGIN;
+static int gc_step = GC_DEFAULT_STEP;
+// Running estimate of one step in microseconds
+static uint32_t gc_cost = GC_INITIAL_COST;
+// Heap size in KB when the last idle cycle finished
+static int gc_settled;
+
+/**
+ * ready_insert - Queues a due task
+ *
+ * @task: Task to queue.
+ *
+ * Keeps the queue sorted by deadline, tasks
+ * with equal deadlines run in queue order.
+ */
+static void ready_insert(struct sched_task *task)
+{
+  struct sched_task **link = &ready_head;
+
+  while(*link && (*link)->deadline <= task->deadline)
+    link = &(*link)->next;
+  task->next = *link;
+  *link = task;
+}
+
+/**
+ * wheel_insert - Parks a task in the timer wheel
+ *
+ * @task: Task with expires set.
+ *
+ * Picks the level by distance from wheel_tick,
+ * so insertion is constant time.
+ */
+static void wheel_insert(struct sched_task *task)
+{
+  uint64_t expires = task->expires;
+  uint64_t delta;
+  struct sched_task **slot;
+
+  if(expires < wheel_tick)
+    expires = wheel_tick;
+  delta = expires - wheel_tick;
+
+  if(delta < WHEEL0_SIZE) {
+    slot = &wheel0[expires & (WHEEL0_SIZE - 1)];
+  } else if(delta < (1ULL << WHEEL_SHIFT(2))) {
+    slot = &wheeln[0][(expires >> WHEEL_SHIFT(1)) & (WHEELN_SIZE - 1)];
+  } else if(delta < (1ULL << WHEEL_SHIFT(3))) {
+    slot = &wheeln[1][(expires >> WHEEL_SHIFT(2)) & (WHEELN_SIZE - 1)];
+  } else {
+    // Out of range deadlines wait in the last slot and cascade again
+    if(delta >= WHEEL_RANGE)
+      expires = wheel_tick + WHEEL_RANGE - 1;
+    slot = &wheeln[2][(expires >> WHEEL_SHIFT(3)) & (WHEELN_SIZE - 1)];
+  }
+
+  task->next = *slot;
+  *slot = task;
+  wheel_count++;
+}
+
+/**
+ * sched_queue - Queues a task by its deadline
+ *
+ * @task: Task to queue.
+ */
+static void sched_queue(struct sched_task *task)
+{
+  task->expires = task->deadline >> SCHED_TICK_SHIFT;
+  if(task->expires < wheel_tick)
+    ready_insert(task);
+  else
+    wheel_insert(task);
+}
+
+/**
+ * wheel_cascade - Moves one slot of a level down
+ *
+ * @level: Level 1 to 3.
+ *
+ * Returns the slot index that was emptied.
+ */
+static uint32_t wheel_cascade(int level)
+{
+  uint32_t index = (wheel_tick >> WHEEL_SHIFT(level)) & (WHEELN_SIZE - 1);
+  struct sched_task *task = wheeln[level - 1][index];
+  struct sched_task *next;
+
+  wheeln[level - 1][index] = 0;
+  while(task) {
+    next = task->next;
+    wheel_count--;
+    wheel_insert(task);
+    task = next;
+  }
+  return index;
+}
+
+/**
+ * wheel_advance - Expires ticks up to now
+ *
+ * @now: Current time in microseconds.
+ *
+ * Moves tasks from expired slots to the
+ * ready queue.
+ */
+static void wheel_advance(uint64_t now)
+{
+  uint64_t now_tick = now >> SCHED_TICK_SHIFT;
+  uint32_t index;
+  struct sched_task *task;
+  struct sched_task *next;
+
+  while(wheel_tick <= now_tick) {
+    if(wheel_count == 0) {
+      wheel_tick = now_tick + 1;
+      break;
+    }
+
+    index = wheel_tick & (WHEEL0_SIZE - 1);
+    if(!index && !wheel_cascade(1) && !wheel_cascade(2))
+      wheel_cascade(3);
+
+    task = wheel0[index];
+    wheel0[index] = 0;
+    while(task) {
+      next = task->next;
+      wheel_count--;
+      ready_insert(task);
+      task = next;
+    }
+    wheel_tick++;
+  }
+}
+
+/**
+ * wheel_next - Finds when the wheel needs attention
+ *
+ * Returns the earliest deadline in the lowest
+ * level, or the next cascade if it is empty.
+ */
+static uint64_t wheel_next()
+{
+  uint64_t tick;
+  uint64_t next;
+  struct sched_task *task;
+  uint32_t i;
+
+  if(wheel_count == 0)
+    return UINT64_MAX;
+
+  for(i = 0; i < WHEEL0_SIZE; i++) {
+    tick = wheel_tick + i;
+    if(i && !(tick & (WHEEL0_SIZE - 1)))
+      break;
+    task = wheel0[tick & (WHEEL0_SIZE - 1)];
+    if(task) {
+      next = UINT64_MAX;
+      for(; task; task = task->next)
+	if(task->deadline < next)
+	  next = task->deadline;
+      return next;
+    }
+  }
+  // Nothing due before the next cascade
+  return ((wheel_tick | (WHEEL0_SIZE - 1)) + 1) << SCHED_TICK_SHIFT;
+}
+
+/**
+ * sched_resume - Runs a task until it yields or ends
+ *
+ * @task: Task taken off the ready queue.
+ */
+static void sched_resume(struct sched_task *task)
+{
+  int status;
+  int nargs = task->nargs;
+
+  task->nargs = 0;
+  // A plain coroutine.yield() puts the task at the back of the queue
+  task->deadline = timer_now();
+
+  sched_current = task;
+  status = lua_resume(task->co, nargs);
+  sched_current = 0;
+
+  if(status == LUA_YIELD) {
+    lua_settop(task->co, 0);
+    if(task->event) {
+      task->next = event_waiters;
+      event_waiters = task;
+    } else {
+      sched_queue(task);
+    }
+    return;
+  }
+
+  if(status != 0) {
+    luaL_traceback(sched_L, task->co, lua_tostring(task->co, -1), 0);
+    printf("Task error: %s\n", lua_tostring(sched_L, -1));
+    lua_pop(sched_L, 1);
+  }
+
+  luaL_unref(sched_L, LUA_REGISTRYINDEX, task->ref);
+  free(task);
+  task_count--;
+}
+
+/**
+ * events_collect - Readies tasks whose event fired
+ *
+ * @now: Current time in microseconds.
+ */
+static void events_collect(uint64_t now)
+{
+  struct sched_task **link = &event_waiters;
+  struct sched_task *task;
+
+  while(*link) {
+    task = *link;
+    if(task->event->signaled) {
+      *link = task->next;
+      if(task->event->results)
+        task->nargs = task->event->results(task->co, task->event);
+      task->event = 0;
+      task->deadline = now;
+      ready_insert(task);
+    } else {
+      link = &task->next;
+    }
+  }
+}
+
+/**
+ * events_pending - Checks for fired events nobody collected
+ *
+ * Called with IRQs masked right before sleeping,
+ * so a signal that raced the last collect is not
+ * slept through.
+ */
+static int events_pending(sched_event *ev)
+{
+  struct sched_task *task;
+
+  if(ev && ev->signaled)
+    return 1;
+  for(task = event_waiters; task; task = task->next)
+    if(task->event->signaled)
+      return 1;
+  return 0;
+}
+
+/**
+ * sched_loop - Runs tasks until a deadline or an event
+ *
+ * @until: Time to return at, or 0 for no deadline.
+ * @ev: Event to return on, or 0.
+ *
+ * With neither, returns once no tasks are left.
+ */
+static void sched_loop(uint64_t until, sched_event *ev)
+{
+  uint64_t now;
+  uint64_t next;
+  uint32_t cpsr;
+  struct sched_task *task;
+
+  while(1) {
+    now = timer_now();
+    wheel_advance(now);
+    events_collect(now);
+
+    if(ev && ev->signaled)
+      return;
+
+    if(ready_head && ready_head->deadline <= now) {
+      task = ready_head;
+      ready_head = task->next;
+      sched_resume(task);
+      continue;
+    }
+
+    if(until ? now >= until : (ev == 0 && task_count == 0))
+      return;
+
+    next = wheel_next();
+    if(ready_head && ready_head->deadline < next)
+      next = ready_head->deadline;
+    if(until && until < next)
+      next = until;
+
+    // Idle work must not hold back an event that fires meanwhile
+    if((ev || event_waiters) && now + EVENT_IDLE_SLICE < next)
+      timer_run_idle_hooks(now + EVENT_IDLE_SLICE);
+    else
+      timer_run_idle_hooks(next);
+    cpsr = irq_save();
+    if(!events_pending(ev))
+      timer_idle(next);
+    irq_restore(cpsr);
+  }
+}
+
+void sched_run(uint64_t until)
+{
+  sched_loop(until, 0);
+}
+
+void sched_event_reset(sched_event *ev)
+{
+  ev->signaled = 0;
+}
+
+void sched_event_signal(sched_event *ev)
+{
+  ev->signaled = 1;
+}
+
+/**
+ * event_results - Pushes what a finished wait returns
+ *
+ * @L: Lua state that waited.
+ * @ev: Event that fired.
+ */
+static int event_results(lua_State *L, sched_event *ev)
+{
+  return ev->results ? ev->results(L, ev) : 0;
+}
+
+int sched_event_wait(lua_State *L, sched_event *ev)
+{
+  uint32_t cpsr;
+
+  if(ev->signaled)
+    return event_results(L, ev);
+
+  if(sched_current && sched_current->co == L) {
+    sched_current->event = ev;
+    return lua_yield(L, 0);
+  }
+
+  if(sched_current == 0) {
+    sched_loop(0, ev);
+    return event_results(L, ev);
+  }
+
+  // A coroutine inside a task cannot yield to the scheduler
+  while(!ev->signaled) {
+    cpsr = irq_save();
+    if(!ev->signaled)
+      wait_for_interrupt();
+    irq_restore(cpsr);
+  }
+  return event_results(L, ev);
+}
+
+int sched_pending()
+{
+  return task_count;
+}
+
+/**
+ * sched_wait - Blocks the caller until a deadline
+ *
+ * @L: Lua state calling sleep or waitUntil.
+ * @deadline: Time from timer_now to continue at.
+ *
+ * Tasks yield back to the scheduler. The main
+ * chunk runs the scheduler until the deadline.
+ * Other coroutines cannot yield to it and
+ * simply sleep.
+ */
+static int sched_wait(lua_State *L, uint64_t deadline)
+{
+  if(sched_current && sched_current->co == L) {
+    sched_current->deadline = deadline;
+    return lua_yield(L, 0);
+  }
+
+  if(sched_current == 0)
+    sched_run(deadline ? deadline : 1);
+  else
+    timer_sleep_idle(deadline);
+  return 0;
+}
+
+/**
+ * sched_gc_idle - Collects garbage while waiting
+ *
+ * @deadline: Time the caller has to be awake at.
+ *
+ * Runs incremental GC steps as long as the
+ * estimated cost of the next one, plus the
+ * margin, fits before the deadline, and no
+ * event has fired. Once a cycle finishes it
+ * waits for the heap to grow again, so an
+ * idle system can sleep.
+ */
+static void sched_gc_idle(uint64_t deadline)
+{
+  uint64_t start;
+  uint64_t now;
+  uint32_t cost;
+
+  if(!gc_enabled || sched_L == 0)
+    return;
+  if(lua_gc(sched_L, LUA_GCCOUNT, 0) < gc_settled + gc_step)
+    return;
+
+  now = timer_now();
+  while(now + gc_cost + gc_margin < deadline && !events_pending(0)) {
+    start = now;
+    if(lua_gc(sched_L, LUA_GCSTEP, gc_step)) {
+      gc_settled = lua_gc(sched_L, LUA_GCCOUNT, 0);
+      break;
+    }
+    now = timer_now();
+
+    // Follow increases at once and decreases slowly
+    cost = (uint32_t)(now - start);
+    if(cost > gc_cost)
+      gc_cost = cost;
+    else
+      gc_cost = (gc_cost * 7 + cost) / 8;
+  }
+}
+
+void sched_close()
+{
+  timer_remove_idle_hook(sched_gc_idle);
+  sched_L = 0;
+}
+
+/**
+ * l_spawn - Starts a task
+ *
+ * @L: Lua environment
+ *
+ * spawn(fn, ...) runs fn(...) as a task and
+ * returns an opaque handle. The coroutine stays
+ * hidden so only the scheduler resumes it.
+ */
+static int l_spawn(lua_State *L)
+{
+  struct sched_task *task;
+  lua_State *co;
+  int nargs = lua_gettop(L) - 1;
+  int ref;
+
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+
+  // Everything that can raise an error comes before the malloc
+  co = lua_newthread(L);
+  if(!lua_checkstack(co, nargs + 1))
+    return luaL_error(L, "Scheduler Error: Too many arguments to spawn.");
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, LUA_TASK);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -2);
+  ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  task = malloc(sizeof(struct sched_task));
+  if(task == 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return luaL_error(L, "Scheduler Error: Out of memory.");
+  }
+  task->ref = ref;
+  task->co = co;
+  task->nargs = nargs;
+  task->event = 0;
+
+  // Keep the handle, drop the thread, which the registry holds
+  lua_insert(L, 1);
+  lua_pop(L, 1);
+  // Move the function and its arguments onto the new thread
+  lua_xmove(L, co, nargs + 1);
+
+  task->deadline = timer_now();
+  ready_insert(task);
+  task_count++;
+
+  return 1;
+}
+
+static int l_sleep(lua_State *L)
+{
+  double ms = luaL_checknumber(L, 1);
+
+  if(ms < 0)
+    return luaL_error(L, "Scheduler Error: Invalid argument to sleep (expected ms >= 0).");
+  return sched_wait(L, timer_now() + (uint64_t)(ms * 1000));
+}
+
+static int l_wait_until(lua_State *L)
+{
+  double us = luaL_checknumber(L, 1);
+
+  if(us < 0)
+    return luaL_error(L, "Scheduler Error: Invalid argument to waitUntil (expected micros >= 0).");
+  return sched_wait(L, (uint64_t)us);
+}
+
+static int l_set_idle_gc(lua_State *L)
+{
+  double margin;
+  double step;
+
+  if(lua_isboolean(L, 1)) {
+    gc_enabled = lua_toboolean(L, 1);
+    return 0;
+  }
+
+  margin = luaL_checknumber(L, 1);
+  step = luaL_optnumber(L, 2, GC_DEFAULT_STEP);
+  if(margin < 0 || (double)(uint32_t)margin != margin)
+    return luaL_error(L, "Scheduler Error: Invalid argument to setIdleGC (expected micros >= 0).");
+  if(step < 1 || (double)(int)step != step)
+    return luaL_error(L, "Scheduler Error: Invalid argument to setIdleGC (expected KB >= 1).");
+
+  gc_enabled = 1;
+  gc_margin = (uint32_t)margin;
+  gc_step = (int)step;
+  gc_settled = 0;
+  return 0;
+}
+
+static int l_micros(lua_State *L)
+{
+  lua_pushnumber(L, (lua_Number)timer_now());
+  return 1;
+}
+
+static int l_millis(lua_State *L)
+{
+  lua_pushnumber(L, (lua_Number)(timer_now() / 1000));
+  return 1;
+}
+
+void sched_register(lua_State *L)
+{
+  sched_L = L;
+  wheel_tick = timer_now() >> SCHED_TICK_SHIFT;
+
+  luaL_newmetatable(L, LUA_TASK);
+  lua_pushliteral(L, "task");
+  lua_setfield(L, -2, "__metatable");
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, l_spawn);
+  lua_setglobal(L, "spawn");
+  lua_pushcfunction(L, l_sleep);
+  lua_setglobal(L, "sleep");
+  lua_pushcfunction(L, l_wait_until);
+  lua_setglobal(L, "waitUntil");
+  lua_pushcfunction(L, l_micros);
+  lua_setglobal(L, "micros");
+  lua_pushcfunction(L, l_millis);
+  lua_setglobal(L, "millis");
+  lua_pushcfunction(L, l_set_idle_gc);
+  lua_setglobal(L, "setIdleGC");
+
+  timer_add_idle_hook(sched_gc_idle);
+}
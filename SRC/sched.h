@@ -0,0 +1,108 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "LUA/lua.h"
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#define LUA_TASK "CirnOS.task"
+
+// One wheel tick is 2^8 = 256 microseconds
+#define SCHED_TICK_SHIFT        8
+
+// A flag tasks can block on until an interrupt handler sets it
+typedef struct sched_event {
+  volatile uint32_t signaled;
+  // Optional, pushes the values sched_event_wait returns
+  // to Lua once the event fired, returns their count
+  int (*results)(lua_State *L, struct sched_event *ev);
+} sched_event;
+
+/**
+ * sched_register - Adds the scheduler to Lua
+ *
+ * @L: Lua environment to add to
+ *
+ * Registers spawn, sleep, waitUntil, micros,
+ * millis and setIdleGC, and starts collecting
+ * garbage while the core waits.
+ */
+void sched_register(lua_State *L);
+
+/**
+ * sched_run - Runs spawned tasks
+ *
+ * @until: Time from timer_now to return at,
+ *         or 0 to return once no tasks are left.
+ *
+ * Resumes tasks in deadline order and
+ * sleeps the core while none is due.
+ */
+void sched_run(uint64_t until);
+
+/**
+ * sched_pending - Counts live tasks
+ *
+ * Returns the number of spawned tasks
+ * that have not finished.
+ */
+int sched_pending();
+
+/**
+ * sched_event_reset - Clears an event before starting work
+ *
+ * @ev: Event to clear. The results
+ *      callback is kept.
+ */
+void sched_event_reset(sched_event *ev);
+
+/**
+ * sched_event_signal - Fires an event
+ *
+ * @ev: Event to fire.
+ *
+ * Safe to call from interrupt handlers. Waiting
+ * tasks run on the next pass of the scheduler.
+ */
+void sched_event_signal(sched_event *ev);
+
+/**
+ * sched_event_wait - Blocks a Lua caller on an event
+ *
+ * @L: Lua state of the calling C function.
+ * @ev: Event to wait for.
+ *
+ * Must be returned from the C function. Tasks
+ * yield to the scheduler, the main chunk runs
+ * the scheduler until the event fires. Work
+ * left after the wait cannot live in the
+ * C function, since a yield does not return
+ * into it, but ev->results can push what the
+ * caller gets back.
+ */
+int sched_event_wait(lua_State *L, sched_event *ev);
+
+/**
+ * sched_close - Detaches the scheduler from Lua
+ *
+ * Stops idle garbage collection. Must be
+ * called before the Lua state is closed.
+ */
+void sched_close();
+
+#endif
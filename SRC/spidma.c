@@ -0,0 +1,196 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include "spidma.h"
+#include "dma.h"
+#include "irq.h"
+#include "mmu.h"
+#include "bcm2835.h"
+
+// In DMA mode every transfer starts with a word holding the length
+// and the low byte of CS, so one header covers at most 64 KiB.
+// Chunks stay a multiple of 4 to keep the packed FIFO words in step.
+#define SPI_DMA_CHUNK           65532
+
+#define SPI_FIFO_BUS (BCM2835_PERI_BUS_BASE + 0x204000 + BCM2835_SPI0_FIFO)
+// Low CS bits the header word rewrites
+#define SPI_CS_SETTINGS (BCM2835_SPI0_CS_CS | BCM2835_SPI0_CS_CPHA | \
+                         BCM2835_SPI0_CS_CPOL | BCM2835_SPI0_CS_CSPOL)
+
+static int tx_channel = -1;
+static int rx_channel = -1;
+
+// Control blocks and headers, grown to the largest transfer seen
+static dma_cb *tx_cbs;
+static dma_cb *rx_cbs;
+static uint32_t *headers;
+static uint32_t chunk_capacity;
+
+// Received bytes go here when the caller does not want them
+static uint32_t rx_discard __attribute__((aligned(32)));
+
+static volatile int busy;
+static uint8_t *rx_buffer;
+static uint32_t rx_length;
+static spi_dma_done_t done_callback;
+static void *done_arg;
+
+/**
+ * spi_dma_complete - RX channel interrupt
+ *
+ * The last RX block raises it once every byte
+ * has been clocked in.
+ */
+static void spi_dma_complete(int channel, void *arg)
+{
+  volatile uint32_t *cs = bcm2835_spi0 + BCM2835_SPI0_CS/4;
+
+  (void)channel;
+  (void)arg;
+
+  *cs &= ~(BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_TA);
+  if(rx_buffer)
+    dcache_invalidate(rx_buffer, rx_length);
+
+  busy = 0;
+  if(done_callback)
+    done_callback(done_arg);
+}
+
+/**
+ * spi_dma_reserve - Makes room for a number of chunks
+ *
+ * @chunks: Chunks the transfer needs.
+ *
+ * Returns 0 on success and -1 when out of memory.
+ */
+static int spi_dma_reserve(uint32_t chunks)
+{
+  if(chunks <= chunk_capacity)
+    return 0;
+
+  dma_cb_free(tx_cbs);
+  dma_cb_free(rx_cbs);
+  free(headers);
+  chunk_capacity = 0;
+
+  tx_cbs = dma_cb_alloc(chunks * 2);
+  rx_cbs = dma_cb_alloc(chunks);
+  headers = memalign(CACHE_LINE_SIZE, chunks * sizeof(uint32_t));
+  if(tx_cbs == 0 || rx_cbs == 0 || headers == 0)
+    return -1;
+
+  chunk_capacity = chunks;
+  return 0;
+}
+
+int spi_dma_start(const uint8_t *tx, uint8_t *rx, uint32_t len, spi_dma_done_t done, void *arg)
+{
+  volatile uint32_t *cs = bcm2835_spi0 + BCM2835_SPI0_CS/4;
+  uint32_t chunks = (len + SPI_DMA_CHUNK - 1) / SPI_DMA_CHUNK;
+  uint32_t settings;
+  uint32_t offset;
+  uint32_t n;
+  uint32_t i;
+
+  if(busy || len == 0)
+    return -1;
+
+  if(tx_channel < 0) {
+    tx_channel = dma_channel_alloc(DMA_CHANNEL_ANY);
+    rx_channel = dma_channel_alloc(DMA_CHANNEL_ANY);
+    if(tx_channel < 0 || rx_channel < 0) {
+      dma_channel_free(tx_channel);
+      dma_channel_free(rx_channel);
+      tx_channel = rx_channel = -1;
+      return -1;
+    }
+    dma_set_callback(rx_channel, spi_dma_complete, 0);
+  }
+  if(spi_dma_reserve(chunks) != 0)
+    return -1;
+
+  settings = (*cs & SPI_CS_SETTINGS) | BCM2835_SPI0_CS_TA;
+
+  for(i = 0, offset = 0; i < chunks; i++, offset += n) {
+    n = len - offset < SPI_DMA_CHUNK ? len - offset : SPI_DMA_CHUNK;
+    headers[i] = (n << 16) | settings;
+
+    // Header, then the data it announces
+    tx_cbs[i * 2].ti = BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_SPI_TX) |
+      BCM2835_DMA_TI_WAIT_RESP;
+    tx_cbs[i * 2].source_ad = dma_bus_address(&headers[i]);
+    tx_cbs[i * 2].dest_ad = SPI_FIFO_BUS;
+    tx_cbs[i * 2].txfr_len = 4;
+    tx_cbs[i * 2].stride = 0;
+    dma_cb_link(&tx_cbs[i * 2], &tx_cbs[i * 2 + 1]);
+
+    tx_cbs[i * 2 + 1].ti = BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_DEST_DREQ |
+      BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_SPI_TX) | BCM2835_DMA_TI_WAIT_RESP;
+    tx_cbs[i * 2 + 1].source_ad = dma_bus_address(tx + offset);
+    tx_cbs[i * 2 + 1].dest_ad = SPI_FIFO_BUS;
+    tx_cbs[i * 2 + 1].txfr_len = (n + 3) & ~3;
+    tx_cbs[i * 2 + 1].stride = 0;
+    dma_cb_link(&tx_cbs[i * 2 + 1], i + 1 < chunks ? &tx_cbs[i * 2 + 2] : 0);
+
+    rx_cbs[i].ti = BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_SPI_RX) |
+      (rx ? BCM2835_DMA_TI_DEST_INC : 0) | (i + 1 == chunks ? BCM2835_DMA_TI_INTEN : 0);
+    rx_cbs[i].source_ad = SPI_FIFO_BUS;
+    rx_cbs[i].dest_ad = dma_bus_address(rx ? rx + offset : (uint8_t *)&rx_discard);
+    rx_cbs[i].txfr_len = (n + 3) & ~3;
+    rx_cbs[i].stride = 0;
+    dma_cb_link(&rx_cbs[i], i + 1 < chunks ? &rx_cbs[i + 1] : 0);
+  }
+
+  dcache_clean(headers, chunks * sizeof(uint32_t));
+  dcache_clean(tx, len);
+  if(rx)
+    dcache_invalidate(rx, len);
+
+  rx_buffer = rx;
+  rx_length = len;
+  done_callback = done;
+  done_arg = arg;
+  busy = 1;
+
+  *cs = (*cs & ~BCM2835_SPI0_CS_TA) | BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS;
+
+  // The receiver has to be listening before the first byte goes out
+  dma_start(rx_channel, rx_cbs);
+  dma_start(tx_channel, tx_cbs);
+
+  return 0;
+}
+
+int spi_dma_busy()
+{
+  return busy;
+}
+
+void spi_dma_wait()
+{
+  uint32_t cpsr;
+
+  while(busy) {
+    cpsr = irq_save();
+    if(busy)
+      wait_for_interrupt();
+    irq_restore(cpsr);
+  }
+}
@@ -0,0 +1,54 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+
+#ifndef SPIDMA_H
+#define SPIDMA_H
+
+typedef void (*spi_dma_done_t)(void *arg);
+
+/**
+ * spi_dma_start - Starts a DMA driven SPI transfer
+ *
+ * @tx: Bytes to send.
+ * @rx: Buffer for the reply, may equal tx, or 0 to drop it.
+ * @len: Number of bytes.
+ * @done: Called from the DMA interrupt when finished, or 0.
+ * @arg: Passed to done.
+ *
+ * Uses the chip select, mode and clock set up with
+ * the bcm2835_spi_* functions. Both buffers must be
+ * cache line aligned, padded to a whole line and at
+ * least a multiple of 4 bytes long. They must not be
+ * touched until the transfer finishes. Returns 0 on
+ * success and -1 if busy or out of DMA channels.
+ */
+int spi_dma_start(const uint8_t *tx, uint8_t *rx, uint32_t len, spi_dma_done_t done, void *arg);
+
+/**
+ * spi_dma_busy - Checks for a running transfer
+ */
+int spi_dma_busy();
+
+/**
+ * spi_dma_wait - Waits for the running transfer
+ *
+ * Sleeps the core until the DMA interrupt.
+ */
+void spi_dma_wait();
+
+#endif
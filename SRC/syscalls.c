@@ -16,6 +16,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -23,6 +24,7 @@
 
 #include "ff.h"
 #include "hdmi.h"
+#include "syscalls.h"
 
 #undef errno
 extern int errno;
@@ -30,6 +32,9 @@ extern int errno;
 #define MAX_OPEN_FILES 20
 FIL *openfiles[MAX_OPEN_FILES];
 
+// Items in a first cluster link map, enough for 15 fragments
+#define CLMT_INITIAL 32
+
 /**
  * _write - Writes bytes to a file
  * 
@@ -112,6 +117,32 @@ int _translateflags(int flags)
     return flags;
 }
 
+FRESULT file_linkmap(FIL *fp)
+{
+    DWORD *tbl = malloc(CLMT_INITIAL * sizeof(DWORD));
+    FRESULT res;
+
+    if (!tbl)
+        return FR_NOT_ENOUGH_CORE;
+    tbl[0] = CLMT_INITIAL;
+    fp->cltbl = tbl;
+    res = f_lseek(fp, CREATE_LINKMAP);
+    if (res == FR_NOT_ENOUGH_CORE) {
+        // tbl[0] now holds the size needed
+        DWORD *bigger = realloc(tbl, tbl[0] * sizeof(DWORD));
+        if (bigger) {
+            tbl = bigger;
+            fp->cltbl = tbl;
+            res = f_lseek(fp, CREATE_LINKMAP);
+        }
+    }
+    if (res != FR_OK) {
+        fp->cltbl = NULL;
+        free(tbl);
+    }
+    return res;
+}
+
 /**
  * _open - Opens a file.
  * 
@@ -125,6 +156,7 @@ int _translateflags(int flags)
  * After, it tries to open the file at name.
  * If it exists then it returns the file
  * handle that it is assigned to.
+ * Files opened read only get fast seek.
  */
 int _open(const char *name, int flags, int perms)
 {
@@ -144,9 +176,13 @@ int _open(const char *name, int flags, int perms)
         return -1;
     }
     if (f_open(fp, name, flags) == FR_OK) {
+        if (flags == FA_READ)
+            // Files without the map still work, just with slower seeks
+            file_linkmap(fp);
         openfiles[fd] = fp;
         return fd + 3;
     }
+    free(fp);
     return -1;
 }
 
@@ -163,8 +199,11 @@ int _open(const char *name, int flags, int perms)
 int _close(int file)
 {
     if (file >= 3 && openfiles[file - 3]) {
-        if (f_close(openfiles[file - 3]) == FR_OK) {
+        FIL *fp = openfiles[file - 3];
+        if (f_close(fp) == FR_OK) {
             openfiles[file - 3] = NULL;
+            free(fp->cltbl);
+            free(fp);
             return 0;
         }
     }
@@ -211,6 +250,7 @@ int _read(int file, char *ptr, int len)
  * STDERR.
  * Changes position in file used by
  * getc, putc etc...
+ * Supports SEEK_SET, SEEK_CUR and SEEK_END.
  */
 int _lseek(int file, int offset, int dir)
 {
@@ -219,22 +259,28 @@ int _lseek(int file, int offset, int dir)
         return -1;
     }
 
-    FSIZE_t fpointer = openfiles[file - 3]->fptr;
-    if (dir == 0)
+    FIL *fp = openfiles[file - 3];
+    int64_t fpointer;
+    if (dir == SEEK_SET)
         fpointer = offset;
-    else if (dir == 1)
-        fpointer = fpointer + offset;
-    // End of file not supported in FatFs library  
+    else if (dir == SEEK_CUR)
+        fpointer = (int64_t)f_tell(fp) + offset;
+    else if (dir == SEEK_END)
+        fpointer = (int64_t)f_size(fp) + offset;
     else {
         errno = EINVAL;
         return -1;
     }
-    while (fpointer > FF_MAX_SS * SDFS.csize) {
-        fpointer -= FF_MAX_SS * SDFS.csize;
-        openfiles[file - 1]->clust++;
+    if (fpointer < 0 || fpointer > 0x7fffffff) {
+        errno = EINVAL;
+        return -1;
     }
-    if (f_lseek(openfiles[file - 3], fpointer) == FR_OK) {
-        return fpointer;
+
+    // Constant time when _open built a link map
+    if (f_lseek(fp, (FSIZE_t)fpointer) == FR_OK) {
+        // Read only files stop at their end, where _read reports EOF,
+        // but fseek expects the position it asked for
+        return (int)fpointer;
     } else {
         errno = EBADF;
         return -1;
@@ -0,0 +1,35 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include "ff.h"
+
+#ifndef SYSCALLS_H
+#define SYSCALLS_H
+
+/**
+ * file_linkmap - Enables fast seek on a file
+ *
+ * @fp: File opened read only.
+ *
+ * Maps the cluster chain into a table so
+ * seeks no longer follow the FAT, fp->cltbl
+ * is set on success. A file in fast seek
+ * mode cannot grow, hence read only.
+ * Returns FR_OK or the f_lseek error.
+ */
+FRESULT file_linkmap(FIL *fp);
+
+#endif
@@ -0,0 +1,154 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include "timer.h"
+#include "irq.h"
+#include "bcm2835.h"
+
+// Assembly Macros
+#include "macros.h"
+
+#define ST_REG(offset) (BCM2835_ST_BASE + (offset))
+
+// Compare registers are 32 bits wide, stay well inside that
+#define TIMER_MAX_IDLE          0x7fffffff
+
+static timer_idle_hook_t idle_hooks[TIMER_IDLE_HOOKS];
+static int idle_running;
+
+/**
+ * timer_match - System timer compare 1 handler
+ *
+ * The wake up itself is the point of the
+ * interrupt, so it only acknowledges it.
+ */
+static void timer_match(void *arg)
+{
+  (void)arg;
+  mmio_write(ST_REG(BCM2835_ST_CS), BCM2835_ST_CS_M1);
+}
+
+void timer_init()
+{
+  mmio_write(ST_REG(BCM2835_ST_CS), BCM2835_ST_CS_M1);
+  irq_register(BCM2835_IRQ_SYSTEM_TIMER_1, timer_match, 0);
+}
+
+uint64_t timer_now()
+{
+  uint32_t hi;
+  uint32_t lo;
+
+  // Re-read if the low word wrapped between the two reads
+  do {
+    hi = mmio_read(ST_REG(BCM2835_ST_CHI));
+    lo = mmio_read(ST_REG(BCM2835_ST_CLO));
+  } while(hi != mmio_read(ST_REG(BCM2835_ST_CHI)));
+
+  return ((uint64_t)hi << 32) | lo;
+}
+
+void timer_idle(uint64_t deadline)
+{
+  uint64_t now = timer_now();
+  uint64_t wait;
+
+  if(now >= deadline)
+    return;
+
+  wait = deadline - now;
+  if(wait < TIMER_MIN_IDLE) {
+    while(timer_now() < deadline) {}
+    return;
+  }
+  if(wait > TIMER_MAX_IDLE)
+    wait = TIMER_MAX_IDLE;
+
+  mmio_write(ST_REG(BCM2835_ST_CS), BCM2835_ST_CS_M1);
+  mmio_write(ST_REG(BCM2835_ST_C1), (uint32_t)(now + wait));
+
+  // The compare only fires on equality, so a deadline
+  // that slipped by while arming would never wake us
+  if(timer_now() >= now + wait)
+    return;
+
+  wait_for_interrupt();
+}
+
+void timer_sleep_until(uint64_t deadline)
+{
+  uint32_t cpsr;
+
+  while(timer_now() < deadline) {
+    cpsr = irq_save();
+    timer_idle(deadline);
+    irq_restore(cpsr);
+  }
+}
+
+void timer_sleep(uint64_t micros)
+{
+  timer_sleep_until(timer_now() + micros);
+}
+
+int timer_add_idle_hook(timer_idle_hook_t hook)
+{
+  int i;
+
+  for(i = 0; i < TIMER_IDLE_HOOKS; i++) {
+    if(idle_hooks[i] == 0) {
+      idle_hooks[i] = hook;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void timer_remove_idle_hook(timer_idle_hook_t hook)
+{
+  int i;
+
+  for(i = 0; i < TIMER_IDLE_HOOKS; i++)
+    if(idle_hooks[i] == hook)
+      idle_hooks[i] = 0;
+}
+
+void timer_run_idle_hooks(uint64_t deadline)
+{
+  int i;
+
+  if(idle_running)
+    return;
+
+  idle_running = 1;
+  for(i = 0; i < TIMER_IDLE_HOOKS; i++)
+    if(idle_hooks[i])
+      idle_hooks[i](deadline);
+  idle_running = 0;
+}
+
+void timer_sleep_idle(uint64_t deadline)
+{
+  uint32_t cpsr;
+
+  while(timer_now() < deadline) {
+    timer_run_idle_hooks(deadline);
+    cpsr = irq_save();
+    timer_idle(deadline);
+    irq_restore(cpsr);
+  }
+}
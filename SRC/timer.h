@@ -0,0 +1,110 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+
+#ifndef TIMER_H
+#define TIMER_H
+
+// Waits shorter than this are spun, a WFI round trip costs about as much
+#define TIMER_MIN_IDLE          10
+#define TIMER_IDLE_HOOKS        4
+
+typedef void (*timer_idle_hook_t)(uint64_t deadline);
+
+/**
+ * timer_init - Hooks up the sleep timer
+ *
+ * Claims system timer compare 1 and its
+ * interrupt. Must run after irq_init.
+ */
+void timer_init();
+
+/**
+ * timer_now - Reads the system timer
+ *
+ * Returns microseconds since boot.
+ */
+uint64_t timer_now();
+
+/**
+ * timer_idle - Sleeps until a deadline or an interrupt
+ *
+ * @deadline: Time from timer_now to wake up at.
+ *
+ * Arms the compare channel and executes WFI once.
+ * Call with IRQs masked and unmask them afterwards
+ * so the pending handler runs; other interrupts
+ * may end the sleep early.
+ */
+void timer_idle(uint64_t deadline);
+
+/**
+ * timer_sleep_until - Sleeps until a deadline
+ *
+ * @deadline: Time from timer_now to wake up at.
+ *
+ * Interrupt handlers keep running while
+ * the core waits.
+ */
+void timer_sleep_until(uint64_t deadline);
+
+/**
+ * timer_sleep - Sleeps for a number of microseconds
+ *
+ * @micros: Time to sleep.
+ */
+void timer_sleep(uint64_t micros);
+
+/**
+ * timer_add_idle_hook - Runs work before sleeping
+ *
+ * @hook: Called with the wake up deadline.
+ *
+ * Hooks run from timer_sleep_idle and the
+ * scheduler, never from driver waits, and
+ * must return before the deadline. Returns
+ * 0 on success and -1 if the list is full.
+ */
+int timer_add_idle_hook(timer_idle_hook_t hook);
+
+/**
+ * timer_remove_idle_hook - Removes an idle hook
+ *
+ * @hook: Hook passed to timer_add_idle_hook.
+ */
+void timer_remove_idle_hook(timer_idle_hook_t hook);
+
+/**
+ * timer_run_idle_hooks - Runs the idle hooks once
+ *
+ * @deadline: Time the caller has to be awake at.
+ *
+ * Does nothing when called from inside a hook.
+ */
+void timer_run_idle_hooks(uint64_t deadline);
+
+/**
+ * timer_sleep_idle - Sleeps until a deadline, doing idle work
+ *
+ * @deadline: Time from timer_now to wake up at.
+ *
+ * Like timer_sleep_until, but gives the idle
+ * hooks the time first.
+ */
+void timer_sleep_idle(uint64_t deadline);
+
+#endif
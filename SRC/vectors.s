@@ -12,13 +12,45 @@
 .equ CPSR_FIQ_INHIBIT,			0x40
 .equ CPSR_THUMB,			0x20
 
+.equ SCTLR_ENABLE_MMU,			0x1
 .equ SCTLR_ENABLE_DATA_CACHE,		0x4
 .equ SCTLR_ENABLE_BRANCH_PREDICTION,	0x800
 .equ SCTLR_ENABLE_INSTRUCTION_CACHE,	0x1000
+.equ SCTLR_EXTENDED_PAGE_TABLE,		0x800000
+
+.equ DACR_DOMAIN0_CLIENT,		0x1
+
+.equ CACHE_LINE_SIZE,			32
+
+
+.equ EXCEPTION_UNDEFINED,		0
+.equ EXCEPTION_PREFETCH_ABORT,		1
+.equ EXCEPTION_DATA_ABORT,		2
+.equ EXCEPTION_UNUSED,			3
 
 
 .global _start	
 _start:
+    // Exception vectors, copied to 0x0 below. Only position
+    // independent loads are used so the copy works as is.
+    ldr pc, reset_vector
+    ldr pc, undefined_vector
+    ldr pc, swi_vector
+    ldr pc, prefetch_abort_vector
+    ldr pc, data_abort_vector
+    ldr pc, unused_vector
+    ldr pc, irq_vector
+    ldr pc, fiq_vector
+reset_vector:		.word reset
+undefined_vector:	.word undefined_handler
+swi_vector:		.word unused_handler
+prefetch_abort_vector:	.word prefetch_abort_handler
+data_abort_vector:	.word data_abort_handler
+unused_vector:		.word unused_handler
+irq_vector:		.word irq_handler
+fiq_vector:		.word unused_handler
+
+reset:
 mov r0, #0x8000
     mov r1, #0x0000
     ldmia r0!,{r2, r3, r4, r5, r6, r7, r8, r9}
@@ -31,6 +63,16 @@ mov r0, #0x8000
 
     mov sp, #0x7000
 
+    mov r0, #(CPSR_MODE_ABORT | CPSR_IRQ_INHIBIT | CPSR_FIQ_INHIBIT)
+    msr cpsr_c, r0
+
+    mov sp, #0x5000
+
+    mov r0, #(CPSR_MODE_UNDEFINED | CPSR_IRQ_INHIBIT | CPSR_FIQ_INHIBIT)
+    msr cpsr_c, r0
+
+    mov sp, #0x4800
+
 	
     mov	r0, #(CPSR_MODE_SVR | CPSR_IRQ_INHIBIT | CPSR_FIQ_INHIBIT)
     msr cpsr_c, r0
@@ -68,6 +110,80 @@ mov r0, #0x8000
 	
 hang: b hang
 
+// Saves the caller-saved registers, including the VFP ones since
+// the C handlers are built with hard float, and calls irq_dispatch
+irq_handler:
+    sub lr, lr, #4
+    push {r0-r3, r12, lr}
+    fmrx r0, fpscr
+    vpush {d0-d7}
+    // r1 keeps the stack 8 byte aligned for the AAPCS
+    push {r0, r1}
+    bl irq_dispatch
+    pop {r0, r1}
+    vpop {d0-d7}
+    fmxr fpscr, r0
+    ldm sp!, {r0-r3, r12, pc}^
+
+undefined_handler:
+    mov r0, #EXCEPTION_UNDEFINED
+    sub r1, lr, #4
+    b exception
+
+prefetch_abort_handler:
+    mov r0, #EXCEPTION_PREFETCH_ABORT
+    sub r1, lr, #4
+    // Fault address and status
+    mrc p15, #0, r2, c6, c0, #2
+    mrc p15, #0, r3, c5, c0, #1
+    b exception
+
+data_abort_handler:
+    mov r0, #EXCEPTION_DATA_ABORT
+    sub r1, lr, #8
+    // Fault address and status
+    mrc p15, #0, r2, c6, c0, #0
+    mrc p15, #0, r3, c5, c0, #0
+    b exception
+
+unused_handler:
+    mov r0, #EXCEPTION_UNUSED
+    mov r1, lr
+
+exception:
+    bl irq_exception
+    b hang
+
+.globl enable_irq
+enable_irq:
+    cpsie i
+    bx lr
+
+.globl disable_irq
+disable_irq:
+    cpsid i
+    bx lr
+
+// Masks IRQs and returns the previous CPSR for irq_restore
+.globl irq_save
+irq_save:
+    mrs r0, cpsr
+    cpsid i
+    bx lr
+
+.globl irq_restore
+irq_restore:
+    msr cpsr_c, r0
+    bx lr
+
+// Sleeps until an interrupt is pending. Returns even
+// if IRQs are masked, without taking the interrupt.
+.globl wait_for_interrupt
+wait_for_interrupt:
+    mov r0, #0
+    mcr p15, #0, r0, c7, c0, #4
+    bx lr
+
 .globl PUT32
 PUT32:
     str r1,[r0]
@@ -104,6 +220,116 @@ memory_barrier:
     mcr	p15, #0, r0, c7, c10, #5
     mov	pc, lr	
 
+// Turns on the MMU using the translation table in r0.
+// The table must be 16 KiB aligned and identity mapped.
+.globl mmu_enable
+mmu_enable:
+    mov r1, #0
+    // Clean and invalidate the data cache, invalidate the instruction cache
+    mcr p15, #0, r1, c7, c14, #0
+    mcr p15, #0, r1, c7, c5, #0
+    // Data synchronization barrier
+    mcr p15, #0, r1, c7, c10, #4
+    // Invalidate the TLB
+    mcr p15, #0, r1, c8, c7, #0
+    // Only TTBR0 is used, table walks are uncached
+    mcr p15, #0, r1, c2, c0, #2
+    mcr p15, #0, r0, c2, c0, #0
+    // Domain 0 checks the access permissions of each section
+    mov r1, #DACR_DOMAIN0_CLIENT
+    mcr p15, #0, r1, c3, c0, #0
+
+    mrc p15, #0, r1, c1, c0, #0
+    orr r1, #SCTLR_EXTENDED_PAGE_TABLE
+    orr r1, #SCTLR_ENABLE_MMU
+    mcr p15, #0, r1, c1, c0, #0
+
+    // Flush prefetch buffer
+    mov r1, #0
+    mcr p15, #0, r1, c7, c5, #4
+    bx lr
+
+// Invalidates the TLB after a translation table entry was changed
+.globl mmu_invalidate_tlb
+mmu_invalidate_tlb:
+    mov r0, #0
+    mcr p15, #0, r0, c7, c10, #4
+    mcr p15, #0, r0, c8, c7, #0
+    mcr p15, #0, r0, c7, c5, #4
+    bx lr
+
+// Writes dirty data cache lines between r0 and r1 back to memory
+.globl dcache_clean_range
+dcache_clean_range:
+    bic r0, r0, #(CACHE_LINE_SIZE - 1)
+clean_line:
+    mcr p15, #0, r0, c7, c10, #1
+    add r0, r0, #CACHE_LINE_SIZE
+    cmp r0, r1
+    blo clean_line
+    mov r0, #0
+    mcr p15, #0, r0, c7, c10, #4
+    bx lr
+
+// Discards data cache lines between r0 and r1 without writing them back
+.globl dcache_invalidate_range
+dcache_invalidate_range:
+    bic r0, r0, #(CACHE_LINE_SIZE - 1)
+invalidate_line:
+    mcr p15, #0, r0, c7, c6, #1
+    add r0, r0, #CACHE_LINE_SIZE
+    cmp r0, r1
+    blo invalidate_line
+    mov r0, #0
+    mcr p15, #0, r0, c7, c10, #4
+    bx lr
+
+// Writes back and discards data cache lines between r0 and r1
+.globl dcache_flush_range
+dcache_flush_range:
+    bic r0, r0, #(CACHE_LINE_SIZE - 1)
+flush_line:
+    mcr p15, #0, r0, c7, c14, #1
+    add r0, r0, #CACHE_LINE_SIZE
+    cmp r0, r1
+    blo flush_line
+    mov r0, #0
+    mcr p15, #0, r0, c7, c10, #4
+    bx lr
+
+// Writes back and discards the whole data cache
+.globl dcache_flush_all
+dcache_flush_all:
+    mov r0, #0
+    mcr p15, #0, r0, c7, c14, #0
+    mcr p15, #0, r0, c7, c10, #4
+    bx lr
+
+// Called by LuaJIT after it emits machine code. The libgcc version
+// does nothing on bare metal, so new traces would sit in the data
+// cache while the instruction cache still holds stale code.
+.globl __clear_cache
+__clear_cache:
+    bic r0, r0, #(CACHE_LINE_SIZE - 1)
+    mov r2, r0
+clear_cache_clean:
+    mcr p15, #0, r2, c7, c10, #1
+    add r2, r2, #CACHE_LINE_SIZE
+    cmp r2, r1
+    blo clear_cache_clean
+    mov r2, #0
+    mcr p15, #0, r2, c7, c10, #4
+clear_cache_invalidate:
+    mcr p15, #0, r0, c7, c5, #1
+    add r0, r0, #CACHE_LINE_SIZE
+    cmp r0, r1
+    blo clear_cache_invalidate
+    mov r0, #0
+    // Flush branch target cache and prefetch buffer
+    mcr p15, #0, r0, c7, c5, #6
+    mcr p15, #0, r0, c7, c5, #4
+    bx lr
+
 //-------------------------------------------------------------------------
 //
 // Copyright (c) 2012 David Welch dwelch@dwelch.com
@@ -0,0 +1,326 @@
+// CirnOS -- Minimalistic scripting environment for the Raspberry Pi
+// Copyright (C) 2018 Michael Mamic
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+// Host side packer for module archives, see SRC/pak.h.
+//
+//   cc -ISRC -o OBJ/pak TOOLS/pak.c
+//   OBJ/pak [-z] modules.pak DIR
+//
+// Packs every .lua source and .ljbc bytecode file under DIR,
+// leaving out the .lua.ljbc sidecars of the bytecode cache.
+// DIR/gfx/sprite.lua becomes module gfx.sprite and
+// DIR/gfx/init.lua becomes gfx. With -z every module is
+// LZ compressed, as for the initfs linked into the kernel.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define PAK_HOST
+#include "pak.h"
+
+typedef struct module {
+  char *name;
+  char *path;
+  uint32_t hash;
+  uint32_t size;
+  uint8_t *data;          // Bytes stored in the archive
+} module;
+
+static module *modules;
+static size_t module_count;
+static size_t module_cap;
+
+static void die(const char *msg, const char *arg)
+{
+  fprintf(stderr, "pak: %s%s\n", msg, arg ? arg : "");
+  exit(1);
+}
+
+static int ends_with(const char *s, const char *suffix)
+{
+  size_t n = strlen(s);
+  size_t m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// Turns "gfx/sprite.lua" into "gfx.sprite" and "gfx/init.lua" into "gfx"
+static char *module_name(const char *rel)
+{
+  char *name = strdup(rel);
+  char *dot = strrchr(name, '.');
+  char *p;
+
+  *dot = 0;
+  for(p = name; *p; p++)
+    if(*p == '/')
+      *p = '.';
+  if(strcmp(name, "init") != 0 && ends_with(name, ".init"))
+    name[strlen(name) - 5] = 0;
+  return name;
+}
+
+static void add_module(const char *path, const char *rel)
+{
+  struct stat st;
+  module *m;
+  size_t i;
+
+  if(stat(path, &st) != 0)
+    die("cannot stat ", path);
+  if(module_count == module_cap) {
+    module_cap = module_cap ? module_cap * 2 : 64;
+    modules = realloc(modules, module_cap * sizeof(module));
+    if(!modules)
+      die("out of memory", 0);
+  }
+
+  m = &modules[module_count];
+  m->name = module_name(rel);
+  m->path = strdup(path);
+  m->hash = pak_hash(m->name);
+  m->size = (uint32_t)st.st_size;
+  for(i = 0; i < module_count; i++)
+    if(strcmp(modules[i].name, m->name) == 0)
+      die("two files for module ", m->name);
+  module_count++;
+}
+
+// Collects modules under dir, rel is the path below the root
+static void scan(const char *dir, const char *rel)
+{
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+
+  if(!d)
+    die("cannot open ", dir);
+  while((ent = readdir(d))) {
+    char path[4096];
+    char sub[4096];
+    struct stat st;
+
+    if(ent->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    snprintf(sub, sizeof(sub), "%s%s%s", rel, *rel ? "/" : "", ent->d_name);
+    if(stat(path, &st) != 0)
+      die("cannot stat ", path);
+    if(S_ISDIR(st.st_mode))
+      scan(path, sub);
+    else if(ends_with(ent->d_name, ".lua.ljbc"))
+      continue;
+    else if(ends_with(ent->d_name, ".lua") || ends_with(ent->d_name, ".ljbc"))
+      add_module(path, sub);
+  }
+  closedir(d);
+}
+
+static int by_hash(const void *a, const void *b)
+{
+  const module *x = a;
+  const module *y = b;
+
+  if(x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+static void put32(FILE *f, uint32_t v)
+{
+  uint8_t b[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+  if(fwrite(b, 1, 4, f) != 4)
+    die("write failed", 0);
+}
+
+static uint8_t *read_file(const char *path, uint32_t size)
+{
+  FILE *in = fopen(path, "rb");
+  uint8_t *data = malloc(size ? size : 1);
+
+  if(!in)
+    die("cannot open ", path);
+  if(!data)
+    die("out of memory", 0);
+  if(fread(data, 1, size, in) != size)
+    die("cannot read ", path);
+  fclose(in);
+  return data;
+}
+
+#define LZ_HASH_BITS    14
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+  return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Flushes literals from..to as runs of at most PAK_LZ_MAX_LITERALS
+static uint8_t *lz_literals(uint8_t *out, const uint8_t *from, const uint8_t *to)
+{
+  while(from < to) {
+    uint32_t n = to - from;
+    if(n > PAK_LZ_MAX_LITERALS)
+      n = PAK_LZ_MAX_LITERALS;
+    *out++ = n - 1;
+    memcpy(out, from, n);
+    out += n;
+    from += n;
+  }
+  return out;
+}
+
+/**
+ * lz_compress - Greedy LZ in the format pak_unlz reads
+ *
+ * @src: Bytes to compress.
+ * @size: Number of bytes.
+ * @out_size: Set to the size of the result.
+ *
+ * The result starts with the uncompressed size.
+ */
+static uint8_t *lz_compress(const uint8_t *src, uint32_t size, uint32_t *out_size)
+{
+  static int32_t head[1 << LZ_HASH_BITS];
+  // Worst case is one literal then a shortest match, 5 bytes for 4
+  uint8_t *out = malloc(4 + size + size / 4 + PAK_LZ_MAX_LITERALS + 1);
+  uint8_t *o = out + 4;
+  uint32_t literals = 0;
+  uint32_t i = 0;
+
+  if(!out)
+    die("out of memory", 0);
+  out[0] = size;
+  out[1] = size >> 8;
+  out[2] = size >> 16;
+  out[3] = size >> 24;
+  memset(head, 0xff, sizeof(head));
+
+  while(i + PAK_LZ_MIN_MATCH <= size) {
+    uint32_t h = lz_hash(src + i);
+    int32_t cand = head[h];
+    uint32_t len = 0;
+
+    head[h] = i;
+    if(cand >= 0 && i - cand <= PAK_LZ_WINDOW) {
+      uint32_t max = size - i;
+      if(max > PAK_LZ_MAX_MATCH)
+        max = PAK_LZ_MAX_MATCH;
+      while(len < max && src[cand + len] == src[i + len])
+        len++;
+    }
+
+    if(len < PAK_LZ_MIN_MATCH) {
+      i++;
+      continue;
+    }
+    o = lz_literals(o, src + literals, src + i);
+    *o++ = 0x80 | (len - PAK_LZ_MIN_MATCH);
+    *o++ = (i - cand);
+    *o++ = (i - cand) >> 8;
+    // Index the skipped positions so later matches can find them
+    for(len += i++; i < len && i + PAK_LZ_MIN_MATCH <= size; i++)
+      head[lz_hash(src + i)] = i;
+    i = len;
+    literals = i;
+  }
+  o = lz_literals(o, src + literals, src + size);
+
+  *out_size = o - out;
+  return out;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t version = PAK_VERSION;
+  uint32_t names_size = 0;
+  uint32_t raw_total = 0;
+  uint32_t offset;
+  uint32_t name;
+  FILE *out;
+  size_t i;
+
+  if(argc == 4 && strcmp(argv[1], "-z") == 0) {
+    version |= PAK_FLAG_LZ;
+    argv++;
+    argc--;
+  }
+  if(argc != 3) {
+    fprintf(stderr, "usage: pak [-z] ARCHIVE DIR\n");
+    return 1;
+  }
+
+  scan(argv[2], "");
+  qsort(modules, module_count, sizeof(module), by_hash);
+  for(i = 0; i < module_count; i++) {
+    module *m = &modules[i];
+    names_size += strlen(m->name) + 1;
+    m->data = read_file(m->path, m->size);
+    raw_total += m->size;
+    if(version & PAK_FLAG_LZ) {
+      uint32_t size;
+      uint8_t *packed = lz_compress(m->data, m->size, &size);
+      uint8_t *check = malloc(m->size ? m->size : 1);
+      if(!check || pak_unlz(packed + 4, size - 4, check, m->size) != 0 ||
+         memcmp(check, m->data, m->size) != 0)
+        die("compression check failed for ", m->path);
+      free(check);
+      free(m->data);
+      m->data = packed;
+      m->size = size;
+    }
+  }
+
+  out = fopen(argv[1], "wb");
+  if(!out)
+    die("cannot create ", argv[1]);
+
+  put32(out, PAK_MAGIC);
+  put32(out, version);
+  put32(out, module_count);
+  put32(out, names_size);
+
+  // Data starts word aligned after the names
+  offset = sizeof(pak_header) + module_count * sizeof(pak_entry) + names_size;
+  offset = (offset + 3) & ~3u;
+  name = 0;
+  for(i = 0; i < module_count; i++) {
+    put32(out, modules[i].hash);
+    put32(out, name);
+    put32(out, offset);
+    put32(out, modules[i].size);
+    name += strlen(modules[i].name) + 1;
+    offset = (offset + modules[i].size + 3) & ~3u;
+  }
+  for(i = 0; i < module_count; i++)
+    fwrite(modules[i].name, 1, strlen(modules[i].name) + 1, out);
+
+  for(i = 0; i < module_count; i++) {
+    while(ftell(out) & 3)
+      fputc(0, out);
+    if(fwrite(modules[i].data, 1, modules[i].size, out) != modules[i].size)
+      die("write failed", 0);
+  }
+
+  offset = ftell(out);
+  if(fclose(out) != 0)
+    die("write failed", 0);
+  printf("pak: %u modules in %s, %u of %u bytes\n", (unsigned)module_count,
+         argv[1], (unsigned)offset, (unsigned)raw_total);
+  return 0;
+}
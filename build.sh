@@ -21,11 +21,22 @@ set -e
 
 GCC_OPTS=" -Wall -O2 -nostartfiles -nostdlib -ffreestanding -mcpu=arm1176jzf-s -mfpu=vfp -mhard-float -ISRC -I/usr/lib/arm-none-eabi/include"
 
+# CACHE=0 ./build.sh leaves the MMU off, so only instruction fetches are cached
+if [ "$CACHE" = "0" ]; then
+    GCC_OPTS="$GCC_OPTS -DNO_MMU"
+fi
+
 COMPILE="arm-none-eabi-gcc $GCC_OPTS"
 
 mkdir -p OBJ
 
-$COMPILE -o OBJ/CirnOS.elf -T SRC/loader SRC/vectors.s SRC/*.c -L. -lluajit -L/usr/lib/arm-none-eabi/newlib/hard -lc -lgcc -lnosys -lm
+# Host tool for packing Lua modules into an archive, see SRC/pak.h
+cc -O2 -ISRC -o OBJ/pak TOOLS/pak.c
+
+# Compressed archive of INITFS, linked in by SRC/initfs.s
+OBJ/pak -z OBJ/initfs.pak INITFS
+
+$COMPILE -o OBJ/CirnOS.elf -T SRC/loader SRC/vectors.s SRC/initfs.s SRC/*.c -L. -lluajit -L/usr/lib/arm-none-eabi/newlib/hard -lc -lgcc -lnosys -lm
 
 # Extract binary image from ELF executable
 arm-none-eabi-objcopy OBJ/CirnOS.elf -O binary OBJ/cirnos.img